@@ -10,4 +10,5 @@ $gateway->addRoute('POST', '/orders', 'http://127.0.0.1:9002');
 $gateway->listen('0.0.0.0', 8081);
 print_r($gateway->routes());
 
-sleep(60);
+// Serve for a minute; resolver callbacks run on this thread meanwhile.
+$gateway->wait(60000);
@@ -8,38 +8,604 @@ extern "C" {
 
 #include <civetweb.h>
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <future>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <strings.h>
 #include <string>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
 #include <vector>
 
 static zend_class_entry *kislayphp_gateway_ce;
 
+enum kislayphp_method {
+    KISLAYPHP_METHOD_GET,
+    KISLAYPHP_METHOD_HEAD,
+    KISLAYPHP_METHOD_POST,
+    KISLAYPHP_METHOD_PUT,
+    KISLAYPHP_METHOD_DELETE,
+    KISLAYPHP_METHOD_PATCH,
+    KISLAYPHP_METHOD_OPTIONS,
+    KISLAYPHP_METHOD_CONNECT,
+    KISLAYPHP_METHOD_TRACE,
+    KISLAYPHP_METHOD_OTHER,
+};
+
+static const size_t KISLAYPHP_METHOD_KNOWN = KISLAYPHP_METHOD_OTHER;
+static const size_t KISLAYPHP_MAX_ROUTE_PARAMS = 16;
+static const int KISLAYPHP_MAX_RETRIES = 5;
+// Most retries the retry budget can bank.
+static const int KISLAYPHP_RETRY_TOKEN_CAP = 100;
+// Latency charged to a backend for a failed connect or response.
+static const int64_t KISLAYPHP_EWMA_FAILURE_NS = 1000000000;
+// Upstream exchanges a hedged request may have in flight: the original and
+// one hedge.
+static const size_t KISLAYPHP_HEDGE_ATTEMPTS = 2;
+// Samples a route needs before its latency percentile replaces the
+// configured hedge delay.
+static const uint32_t KISLAYPHP_HEDGE_MIN_SAMPLES = 20;
+static const size_t KISLAYPHP_LATENCY_BUCKETS = 128;
+// The latency histogram halves itself every this many samples.
+static const uint32_t KISLAYPHP_LATENCY_WINDOW = 1024;
+// Samples the concurrency limiter's long-run latency average spans.
+static const double KISLAYPHP_LIMIT_RTT_WINDOW = 600.0;
+// How long a key whose fetch did not produce a cache entry is exempt from
+// request coalescing, and how many such keys are remembered.
+static const int64_t KISLAYPHP_CACHE_PASS_NS = 5000000000LL;
+static const size_t KISLAYPHP_CACHE_PASS_KEYS = 4096;
+// Resolver jobs that may queue while nothing is inside wait(); beyond
+// that, requests needing the resolver fail at once.
+static const size_t KISLAYPHP_EXECUTOR_BACKLOG = 1024;
+static const uint64_t KISLAYPHP_DISK_MAGIC = 0x3145484341434b47ULL;
+static const uint32_t KISLAYPHP_DISK_VERSION = 2;
+static const uint32_t KISLAYPHP_DISK_RECORD_MAGIC = 0x4b524543;
+static const size_t KISLAYPHP_DISK_PAGE_BYTES = 1 << 20;
+// Offset in page 0 of the table of page slab classes.
+static const size_t KISLAYPHP_DISK_TABLE_OFFSET = 4096;
+// Slab classes of 1 KiB to 1 MiB chunks.
+static const uint8_t KISLAYPHP_DISK_CLASSES = 11;
+static const uint8_t KISLAYPHP_DISK_UNASSIGNED = 0xff;
+// Independently locked parts of the persistent tier (fewer in files with
+// fewer data pages).
+static const size_t KISLAYPHP_DISK_SHARDS = 16;
+
+struct kislayphp_upstream;
+
+struct kislayphp_endpoint {
+    std::string target;
+    std::string host;
+    int port = 0;
+    std::string base_path;
+    kislayphp_upstream *upstream = nullptr;
+};
+
+enum kislayphp_balancer {
+    KISLAYPHP_BALANCE_ROUND_ROBIN,
+    KISLAYPHP_BALANCE_LEAST_CONN,
+    KISLAYPHP_BALANCE_P2C,
+    KISLAYPHP_BALANCE_MAGLEV,
+    KISLAYPHP_BALANCE_PEAK_EWMA,
+};
+
+enum kislayphp_hash_source {
+    KISLAYPHP_HASH_IP,
+    KISLAYPHP_HASH_HEADER,
+    KISLAYPHP_HASH_COOKIE,
+    KISLAYPHP_HASH_SEGMENT,
+    KISLAYPHP_HASH_PARAM,
+};
+
+// What a consistent-hash balancer hashes: "ip", "header:<name>",
+// "cookie:<name>", "segment:<n>" (1-based path segment) or "param:<name>".
+struct kislayphp_hash_key {
+    kislayphp_hash_source source = KISLAYPHP_HASH_IP;
+    std::string name;
+    size_t segment = 0;
+    std::string spec = "ip";
+};
+
+struct kislayphp_balancing {
+    kislayphp_balancer balancer = KISLAYPHP_BALANCE_ROUND_ROBIN;
+    kislayphp_hash_key hash_key;
+};
+
+// Endpoints a route or registered service spreads its traffic over. Shared
+// by every copy of the route so balancer state survives table rebuilds.
+struct kislayphp_target_set {
+    std::vector<kislayphp_endpoint> endpoints;
+    kislayphp_balancing balancing;
+    // Maglev lookup table of endpoint indexes, built once per set.
+    std::vector<uint16_t> maglev;
+    std::atomic<uint64_t> next{0};
+};
+
+struct kislayphp_resolution {
+    kislayphp_endpoint endpoint;
+    uint64_t generation = 0;
+    std::chrono::steady_clock::time_point fresh_until;
+    std::chrono::steady_clock::time_point stale_until;
+};
+
+// Cached resolver answer for one service route, i.e. one (service, method,
+// pattern) key. Copies of the route made by table rebuilds share the slot.
+struct kislayphp_resolution_slot {
+    std::mutex lock;
+    std::shared_ptr<const kislayphp_resolution> current;
+    std::atomic<bool> refreshing{false};
+};
+
+enum kislayphp_job_state {
+    KISLAYPHP_JOB_PENDING,
+    KISLAYPHP_JOB_RUNNING,
+    KISLAYPHP_JOB_CANCELLED,
+};
+
+// One resolver invocation. Inputs are copied so a refresh job can outlive
+// the request that queued it.
+struct kislayphp_resolve_job {
+    std::shared_ptr<kislayphp_resolution_slot> slot;
+    std::string service;
+    std::string method;
+    std::string path;
+    std::vector<std::pair<std::string, std::string>> params;
+    bool refresh = false;
+    std::atomic<int> state{KISLAYPHP_JOB_PENDING};
+    const char *error = nullptr;
+    int error_status = 502;
+    int ttl_ms = 0;
+    int stale_ms = 0;
+    uint64_t generation = 0;
+    kislayphp_endpoint endpoint;
+    std::promise<void> done;
+};
+
+struct kislayphp_executor_node {
+    std::shared_ptr<kislayphp_resolve_job> job;
+    kislayphp_executor_node *next;
+};
+
+struct kislayphp_hedge_race;
+
+enum kislayphp_breaker_state {
+    KISLAYPHP_BREAKER_CLOSED,
+    KISLAYPHP_BREAKER_OPEN,
+    KISLAYPHP_BREAKER_HALF_OPEN,
+};
+
+struct kislayphp_breaker_config {
+    uint32_t failures = 0;
+    int open_ms = 10000;
+    uint32_t half_open_requests = 1;
+};
+
+// Circuit breaker state. The closed state is handled with atomics only;
+// lock guards the rarer transitions and the half-open probe counters.
+struct kislayphp_breaker {
+    std::atomic<int> state{KISLAYPHP_BREAKER_CLOSED};
+    std::atomic<uint32_t> failures{0};
+    std::atomic<int64_t> retry_at{0};
+    std::atomic<uint64_t> opened{0};
+    std::mutex lock;
+    // Counts OPEN -> HALF_OPEN transitions, so probes admitted in an earlier
+    // half-open period can be told apart when they finish late.
+    uint64_t cycle = 0;
+    uint32_t probes = 0;
+    uint32_t successes = 0;
+};
+
+// Log-linear histogram of response-head latencies, four buckets per power
+// of two of microseconds. Halving it every KISLAYPHP_LATENCY_WINDOW samples
+// keeps its percentiles tracking recent traffic.
+struct kislayphp_latency_histogram {
+    std::atomic<uint32_t> buckets[KISLAYPHP_LATENCY_BUCKETS]{};
+    std::atomic<uint32_t> samples{0};
+};
+
 struct kislayphp_gateway_route {
     std::string method;
+    kislayphp_method method_id = KISLAYPHP_METHOD_OTHER;
     std::string path;
-    std::string target;
+    std::shared_ptr<kislayphp_target_set> targets;
     std::string service;
     bool use_service;
-    std::string host;
-    int port;
-    std::string base_path;
+    std::shared_ptr<kislayphp_resolution_slot> resolution;
+    std::vector<std::string> param_names;
+    std::vector<std::string> param_headers;
+    kislayphp_breaker_config breaker_config;
+    std::shared_ptr<kislayphp_breaker> breaker;
+    // Per-route overrides of the gateway timeouts; negative (unset) inherits.
+    // A timeout_ms of 0 means no total deadline, as for the gateway.
+    int first_byte_timeout_ms = -1;
+    int timeout_ms = -1;
+    int retries = -1;
+    // Response caching for GET/HEAD: cache_ttl (seconds) applies to 200
+    // responses that carry no freshness information of their own.
+    bool cache = false;
+    int cache_ttl = 0;
+    size_t cache_max_entry_bytes = 1 << 20;
+    // Hedging of GET/HEAD requests: a second upstream is tried once the
+    // first has not answered within this percentile of the route's recent
+    // latencies (hedge_delay_ms until there are enough samples).
+    double hedge_percentile = 0;
+    int hedge_delay_ms = 0;
+    std::shared_ptr<kislayphp_latency_histogram> latency;
 };
 
-typedef struct _php_kislayphp_gateway_t {
+// Path parameters captured by the router, stored as offsets into the request
+// path the match was made against rather than as copies.
+struct kislayphp_route_match {
+    const kislayphp_gateway_route *route = nullptr;
+    const char *path = nullptr;
+    size_t param_count = 0;
+    size_t param_offset[KISLAYPHP_MAX_ROUTE_PARAMS];
+    size_t param_length[KISLAYPHP_MAX_ROUTE_PARAMS];
+};
+
+// Radix tree node. Edges are compressed into labels and children are kept
+// sorted by the first byte of their label. exact/wildcard hold indexes into
+// the owning table's routes for "<prefix>" and "<prefix>*" respectively.
+// A "{name}" segment is a separate param child that consumes one non-empty
+// path segment.
+struct kislayphp_route_node {
+    std::string label;
+    std::vector<std::unique_ptr<kislayphp_route_node>> children;
+    std::unique_ptr<kislayphp_route_node> param;
+    int exact = -1;
+    int wildcard = -1;
+};
+
+struct kislayphp_router {
+    kislayphp_route_node methods[KISLAYPHP_METHOD_KNOWN];
+    std::vector<std::pair<std::string, std::unique_ptr<kislayphp_route_node>>> other_methods;
+};
+
+struct kislayphp_route_table {
     std::vector<kislayphp_gateway_route> routes;
     kislayphp_gateway_route fallback_route;
-    bool has_fallback;
+    bool has_fallback = false;
+    kislayphp_router router;
+};
+
+struct kislayphp_cache_flight_lead;
+
+struct kislayphp_worker_state {
+    std::vector<char> relay_buffer;
+    // Cache fetch the current request leads, if any.
+    kislayphp_cache_flight_lead *flight = nullptr;
+};
+
+// Immutable value published as a reference-counted pointer. Readers take a
+// reference with one atomic load and keep the value alive for as long as
+// they hold it; writers copy, modify and publish under the owner's mutex.
+// A superseded value is freed when its last reader lets go of it.
+template <typename T>
+struct kislayphp_snapshot {
+    std::shared_ptr<const T> current;
+
+    std::shared_ptr<const T> load() const {
+        return std::atomic_load_explicit(&current, std::memory_order_acquire);
+    }
+
+    void publish(std::shared_ptr<const T> next) {
+        std::atomic_store_explicit(&current, std::move(next), std::memory_order_release);
+    }
+};
+
+struct kislayphp_registry {
+    std::unordered_map<std::string, std::shared_ptr<kislayphp_target_set>> services;
+};
+
+struct kislayphp_pooled_conn {
+    struct mg_connection *conn;
+    std::chrono::steady_clock::time_point created_at;
+    std::chrono::steady_clock::time_point idle_since;
+};
+
+// One backend host:port, interned for the lifetime of the gateway so that
+// endpoints can point at it directly. Owns the idle connection pool and the
+// counters the balancers read.
+struct kislayphp_upstream {
+    std::string host;
+    int port = 0;
+    std::mutex lock;
+    std::vector<kislayphp_pooled_conn> idle;
+    std::atomic<int64_t> in_flight{0};
+    // Peak-EWMA of the time to the response head, in nanoseconds, and the
+    // steady-clock time of the last sample (0 until the first one).
+    std::atomic<double> latency_ewma{0.0};
+    std::atomic<int64_t> latency_stamp{0};
+    double latency_decay_ns = 10e9;
+    // Active health check verdict read by the balancers. The streak
+    // counters are only touched by the health check thread.
+    std::atomic<bool> healthy{true};
+    int health_successes = 0;
+    int health_failures = 0;
+    // Passive outlier detection, fed by live traffic: consecutive 5xx and
+    // transport failures, the steady-clock time the current ejection ends,
+    // and how many ejections in a row have doubled its length.
+    std::atomic<uint32_t> consecutive_errors{0};
+    std::atomic<int64_t> ejected_until{0};
+    std::atomic<uint32_t> ejection_streak{0};
+    std::atomic<uint64_t> ejections{0};
+    // Tripped by routes that configure a circuit breaker, with their
+    // thresholds; shared by every such route using this upstream.
+    kislayphp_breaker breaker;
+    // Adaptive concurrency limit on in_flight (0 when off) and the
+    // requests queued for a slot. The controller state behind it is
+    // guarded by limit_lock: the fractional limit, the long-run average
+    // time to the response head, and when a failure last cut the limit.
+    std::atomic<int64_t> concurrency_limit{0};
+    std::atomic<int64_t> limit_waiters{0};
+    std::mutex limit_lock;
+    std::condition_variable limit_cv;
+    double limit = 0;
+    double rtt_long_ns = 0;
+    int64_t limit_cut_at = 0;
+};
+
+// A cached response, stored as the bytes a hit sends: status line, an Age
+// header whose ten digits are patched per hit, the stored headers,
+// Content-Length, the blank line and the body. vary holds the request
+// header values this variant was stored for.
+struct kislayphp_cache_entry {
+    std::string blob;
+    size_t head_len = 0;
+    size_t age_offset = 0;
+    int status = 200;
+    int64_t stored_ns = 0;
+    int64_t expires_ns = 0;
+    long long initial_age = 0;
+    std::vector<std::pair<std::string, std::string>> vary;
+    // Validators; expired entries that have one are kept for revalidation.
+    std::string etag;
+    std::string last_modified;
+    // Surrogate keys from Surrogate-Key / Cache-Tag, for purgeTags().
+    std::vector<std::string> tags;
+};
+
+// All stored variants of one URL, with its position in the shard's LRU list.
+struct kislayphp_cache_slot {
+    std::vector<std::shared_ptr<const kislayphp_cache_entry>> variants;
+    size_t bytes = 0;
+    std::list<const std::string *>::iterator lru;
+    // Tags under which the slot is indexed; may outlive the variants that
+    // carried them.
+    std::vector<std::string> tags;
+};
+
+struct kislayphp_cache_shard {
+    std::mutex lock;
+    std::unordered_map<std::string, kislayphp_cache_slot> slots;
+    // Most recently used first; points at the keys of slots.
+    std::list<const std::string *> lru;
+    // Inverted index from surrogate key to the keys of slots tagged with it.
+    std::unordered_map<std::string, std::unordered_set<const std::string *>> tags;
+    size_t bytes = 0;
+};
+
+struct kislayphp_disk_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_bytes;
+    uint64_t page_count;
+};
+
+// Head of a record; the key, the serialised entry metadata and the response
+// blob follow it in the chunk.
+struct kislayphp_disk_record {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t meta_len;
+    uint32_t blob_len;
+    // Wall-clock milliseconds, so that ages and expiry survive a restart.
+    int64_t stored_ms;
+    int64_t expires_ms;
+    uint64_t checksum;
+};
+
+struct kislayphp_disk_class {
+    std::vector<uint64_t> pages;
+    std::vector<uint64_t> free;
+    // Next chunk to overwrite once the class has no free chunk and no page
+    // is left to give it, counted over the chunks of its pages.
+    size_t hand = 0;
+};
+
+// One stored record of a cache key. Its Vary values are kept in memory so
+// that picking or replacing a variant does not read the file.
+struct kislayphp_disk_variant {
+    uint64_t offset;
+    std::vector<std::pair<std::string, std::string>> vary;
+};
+
+// The records of the keys that hash to one shard, kept in the data pages
+// dealt to it, and their index.
+struct kislayphp_disk_shard {
+    std::mutex lock;
+    std::vector<uint64_t> unassigned;
+    kislayphp_disk_class classes[KISLAYPHP_DISK_CLASSES];
+    // Records by cache key, oldest first, and offsets by surrogate key.
+    std::unordered_map<std::string, std::vector<kislayphp_disk_variant>> index;
+    std::unordered_map<std::string, std::unordered_set<uint64_t>> tags;
+    size_t entries = 0;
+};
+
+// Persistent second cache tier in a memory-mapped file of 1 MiB pages.
+// Page 0 holds the file header and a table giving the slab class of every
+// other page; those pages are cut into equal chunks of their class (1 KiB
+// to 1 MiB) that each hold at most one record. Together the page table and
+// the self-describing records are the on-disk index, scanned on open to
+// rebuild the in-memory one. Data pages are dealt out to the shards in
+// turn, so the shards never share a page.
+struct kislayphp_disk_tier {
+    int fd = -1;
+    char *base = nullptr;
+    size_t size = 0;
+    uint64_t page_count = 0;
+    std::vector<std::unique_ptr<kislayphp_disk_shard>> shards;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> writes{0};
+
+    ~kislayphp_disk_tier() {
+        if (base != nullptr) {
+            ::munmap(base, size);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+// Upstream fetch of a missing cache entry that identical requests wait on.
+struct kislayphp_cache_flight {
+    bool done = false;
+    std::condition_variable cv;
+};
+
+// Response cache split into independently locked LRU shards, each owning
+// an equal part of the byte budget.
+struct kislayphp_response_cache {
+    std::vector<std::unique_ptr<kislayphp_cache_shard>> shards;
+    size_t shard_budget = 0;
+    std::mutex flight_lock;
+    std::unordered_map<std::string, std::shared_ptr<kislayphp_cache_flight>> flights;
+    // Keys whose last fetch stored nothing, with the time they expire;
+    // requests for them go upstream without waiting on one another.
+    std::unordered_map<std::string, int64_t> passes;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> stores{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> coalesced{0};
+    std::atomic<uint64_t> revalidated{0};
+    std::unique_ptr<kislayphp_disk_tier> disk;
+};
+
+// Held by the request that leads a flight. Releases the waiting requests
+// as soon as its response is stored or turns out not to be cacheable, and
+// at the latest when the request ends.
+struct kislayphp_cache_flight_lead {
+    std::shared_ptr<kislayphp_response_cache> cache;
+    std::string key;
+    std::shared_ptr<kislayphp_cache_flight> flight;
+    kislayphp_worker_state *worker = nullptr;
+
+    void release();
+    ~kislayphp_cache_flight_lead() { release(); }
+};
+
+struct kislayphp_upstream_lease {
+    kislayphp_upstream *pool;
+    struct mg_connection *conn;
+    std::chrono::steady_clock::time_point created_at;
+    bool reused;
+};
+
+typedef struct _php_kislayphp_gateway_t {
+    kislayphp_snapshot<kislayphp_route_table> route_table;
+    kislayphp_snapshot<kislayphp_registry> registry;
     std::mutex lock;
     struct mg_context *ctx;
     bool running;
     size_t max_body_bytes;
+    size_t relay_buffer_bytes;
     int thread_count;
     zval resolver;
     bool has_resolver;
+    int resolve_ttl_ms;
+    int resolve_stale_ms;
+    std::atomic<uint64_t> resolver_generation;
+    std::atomic<uint64_t> resolve_hits;
+    std::atomic<uint64_t> resolve_stale;
+    std::atomic<uint64_t> resolver_calls;
+    std::atomic<uint64_t> resolver_coalesced;
+    std::atomic<kislayphp_executor_node *> executor_head;
+    std::atomic<bool> executor_active;
+    // Set by stop() so queued requests stop waiting for wait().
+    std::atomic<bool> executor_closed;
+    std::atomic<size_t> executor_backlog;
+    // A request gave up on the resolver because no wait() picked it up;
+    // reported once on the PHP thread.
+    std::atomic<bool> executor_missed;
+    bool executor_warned;
+    std::mutex executor_lock;
+    std::condition_variable executor_cv;
+    size_t pool_max_idle;
+    int pool_max_lifetime_ms;
+    int pool_idle_timeout_ms;
+    int ewma_decay_ms;
+    int first_byte_timeout_ms;
+    int total_timeout_ms;
+    int retries;
+    int retry_budget_percent;
+    int retry_min_per_sec;
+    std::atomic<int64_t> retry_tokens;
+    std::atomic<int64_t> retry_refilled;
+    std::atomic<uint64_t> retries_done;
+    std::atomic<uint64_t> retries_denied;
+    std::atomic<uint64_t> hedges;
+    std::atomic<uint64_t> hedge_wins;
+    // Hedge attempts wait for their response head on a pool of at most
+    // hedge_threads_max threads, started on demand. An attempt can outlive
+    // its request; stop() waits for them and joins the pool.
+    size_t hedge_threads_max;
+    size_t hedge_active;
+    bool hedge_stopping;
+    std::vector<std::thread> hedge_pool;
+    std::deque<std::pair<std::shared_ptr<kislayphp_hedge_race>, size_t>> hedge_queue;
+    std::mutex hedge_lock;
+    std::condition_variable hedge_cv;
+    std::condition_variable hedge_work_cv;
+    // Shared by routes with the 'cache' option; null while the budget is 0.
+    std::shared_ptr<kislayphp_response_cache> cache;
+    // Adaptive concurrency limits, off while limit_max is 0.
+    int limit_initial;
+    int limit_min;
+    int limit_max;
+    int limit_queue_ms;
+    double limit_tolerance;
+    double limit_backoff;
+    std::atomic<uint64_t> limit_shed;
+    uint32_t outlier_errors;
+    int outlier_base_ms;
+    int outlier_max_ms;
+    std::string health_path;
+    int health_interval_ms;
+    int health_timeout_ms;
+    int health_healthy_threshold;
+    int health_unhealthy_threshold;
+    std::vector<int> health_statuses;
+    std::thread health_thread;
+    std::mutex health_lock;
+    std::condition_variable health_cv;
+    std::atomic<bool> health_stop;
+    std::unordered_map<std::string, std::unique_ptr<kislayphp_upstream>> upstreams;
+    std::mutex upstream_lock;
+    std::atomic<uint64_t> pool_hits;
+    std::atomic<uint64_t> pool_misses;
+    bool keep_alive;
+    int keep_alive_timeout_ms;
+    size_t keep_alive_max_requests;
     zend_object std;
 } php_kislayphp_gateway_t;
 
@@ -53,6 +619,19 @@ static zend_long kislayphp_env_long(const char *name, zend_long fallback) {
     return static_cast<zend_long>(std::strtoll(value, nullptr, 10));
 }
 
+static std::shared_ptr<kislayphp_response_cache> kislayphp_cache_create(size_t max_bytes, size_t shard_count) {
+    if (max_bytes == 0) {
+        return nullptr;
+    }
+    auto cache = std::make_shared<kislayphp_response_cache>();
+    shard_count = std::min(shard_count, std::max<size_t>(max_bytes / 4096, 1));
+    for (size_t i = 0; i < shard_count; ++i) {
+        cache->shards.emplace_back(new kislayphp_cache_shard());
+    }
+    cache->shard_budget = max_bytes / shard_count;
+    return cache;
+}
+
 static bool kislayphp_is_hop_header(const char *name) {
     if (name == nullptr) {
         return false;
@@ -81,485 +660,5175 @@ static bool kislayphp_is_hop_header(const char *name) {
     return false;
 }
 
-static inline php_kislayphp_gateway_t *php_kislayphp_gateway_from_obj(zend_object *obj) {
-    return reinterpret_cast<php_kislayphp_gateway_t *>(
-        reinterpret_cast<char *>(obj) - XtOffsetOf(php_kislayphp_gateway_t, std));
-}
-
-static zend_object *kislayphp_gateway_create_object(zend_class_entry *ce) {
-    php_kislayphp_gateway_t *obj = static_cast<php_kislayphp_gateway_t *>(
-        ecalloc(1, sizeof(php_kislayphp_gateway_t) + zend_object_properties_size(ce)));
-    zend_object_std_init(&obj->std, ce);
-    object_properties_init(&obj->std, ce);
-    new (&obj->routes) std::vector<kislayphp_gateway_route>();
-    new (&obj->lock) std::mutex();
-    obj->ctx = nullptr;
-    obj->running = false;
-    obj->has_fallback = false;
-    zend_long max_body = kislayphp_env_long("KISLAY_GATEWAY_MAX_BODY", 0);
-    if (max_body < 0) {
-        max_body = 0;
+static bool kislayphp_header_has_token(const char *value, const char *token) {
+    if (value == nullptr) {
+        return false;
     }
-    obj->max_body_bytes = static_cast<size_t>(max_body);
-    zend_long threads = kislayphp_env_long("KISLAY_GATEWAY_THREADS", 1);
-    if (threads < 1) {
-        threads = 1;
+    size_t token_len = std::strlen(token);
+    const char *p = value;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+        }
+        const char *start = p;
+        while (*p != '\0' && *p != ',') {
+            ++p;
+        }
+        const char *end = p;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+            --end;
+        }
+        if (static_cast<size_t>(end - start) == token_len && ::strncasecmp(start, token, token_len) == 0) {
+            return true;
+        }
     }
-    obj->thread_count = static_cast<int>(threads);
-    ZVAL_UNDEF(&obj->resolver);
-    obj->has_resolver = false;
-    obj->std.handlers = &kislayphp_gateway_handlers;
-    return &obj->std;
+    return false;
 }
 
-static void kislayphp_gateway_free_obj(zend_object *object) {
-    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(object);
-    if (obj->ctx != nullptr) {
-        mg_stop(obj->ctx);
-        obj->ctx = nullptr;
+static kislayphp_upstream *kislayphp_upstream_for(php_kislayphp_gateway_t *gateway,
+                                                  const std::string &host,
+                                                  int port) {
+    std::string key = host + ":" + std::to_string(port);
+    std::lock_guard<std::mutex> guard(gateway->upstream_lock);
+    auto it = gateway->upstreams.find(key);
+    if (it != gateway->upstreams.end()) {
+        return it->second.get();
     }
-    if (obj->has_resolver) {
-        zval_ptr_dtor(&obj->resolver);
+    std::unique_ptr<kislayphp_upstream> upstream(new kislayphp_upstream());
+    upstream->host = host;
+    upstream->port = port;
+    upstream->latency_decay_ns = static_cast<double>(gateway->ewma_decay_ms) * 1e6;
+    if (gateway->limit_max > 0) {
+        upstream->limit = gateway->limit_initial;
+        upstream->concurrency_limit.store(gateway->limit_initial, std::memory_order_relaxed);
     }
-    obj->routes.~vector();
-    obj->lock.~mutex();
-    zend_object_std_dtor(&obj->std);
+    auto inserted = gateway->upstreams.emplace(key, std::move(upstream));
+    return inserted.first->second.get();
 }
 
-static std::string kislayphp_to_upper(const std::string &value) {
-    std::string out = value;
-    std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) {
-        return static_cast<char>(std::toupper(c));
-    });
-    return out;
+static void kislayphp_bind_endpoint(php_kislayphp_gateway_t *gateway, kislayphp_endpoint &endpoint) {
+    endpoint.upstream = kislayphp_upstream_for(gateway, endpoint.host, endpoint.port);
 }
 
-static std::string kislayphp_join_paths(const std::string &base, const std::string &path) {
-    if (base.empty()) {
-        return path.empty() ? std::string("/") : path;
-    }
-    if (path.empty()) {
-        return base;
-    }
-    if (base.back() == '/' && path.front() == '/') {
-        return base + path.substr(1);
-    }
-    if (base.back() != '/' && path.front() != '/') {
-        return base + "/" + path;
+static const char *kislayphp_balancer_name(kislayphp_balancer balancer) {
+    switch (balancer) {
+        case KISLAYPHP_BALANCE_LEAST_CONN:
+            return "least_conn";
+        case KISLAYPHP_BALANCE_P2C:
+            return "p2c";
+        case KISLAYPHP_BALANCE_MAGLEV:
+            return "maglev";
+        case KISLAYPHP_BALANCE_PEAK_EWMA:
+            return "peak_ewma";
+        default:
+            return "round_robin";
     }
-    return base + path;
 }
 
-static bool kislayphp_path_matches(const std::string &pattern, const std::string &path) {
-    if (pattern.empty()) {
-        return path.empty() || path == "/";
-    }
-    if (pattern == path) {
-        return true;
-    }
-    if (pattern.back() != '*') {
-        return false;
-    }
-    std::string prefix = pattern.substr(0, pattern.size() - 1);
-    if (prefix.empty()) {
-        return true;
-    }
-    if (path.size() < prefix.size()) {
+static bool kislayphp_balancer_from(const std::string &name, kislayphp_balancer &balancer) {
+    if (name == "round_robin") {
+        balancer = KISLAYPHP_BALANCE_ROUND_ROBIN;
+    } else if (name == "least_conn") {
+        balancer = KISLAYPHP_BALANCE_LEAST_CONN;
+    } else if (name == "p2c") {
+        balancer = KISLAYPHP_BALANCE_P2C;
+    } else if (name == "maglev") {
+        balancer = KISLAYPHP_BALANCE_MAGLEV;
+    } else if (name == "peak_ewma") {
+        balancer = KISLAYPHP_BALANCE_PEAK_EWMA;
+    } else {
         return false;
     }
-    return path.compare(0, prefix.size(), prefix) == 0;
+    return true;
 }
 
-static bool kislayphp_parse_target(const std::string &target, kislayphp_gateway_route &route) {
-    std::string value = target;
-    const std::string prefix = "http://";
-    if (value.rfind(prefix, 0) == 0) {
-        value = value.substr(prefix.size());
-    }
-
-    std::string hostport;
-    std::string base_path = "/";
-    size_t slash = value.find('/');
-    if (slash == std::string::npos) {
-        hostport = value;
+static bool kislayphp_hash_key_from(const std::string &spec, kislayphp_hash_key &key) {
+    size_t colon = spec.find(':');
+    std::string kind = spec.substr(0, colon);
+    std::string name = colon == std::string::npos ? std::string() : spec.substr(colon + 1);
+    if (kind == "ip" && colon == std::string::npos) {
+        key.source = KISLAYPHP_HASH_IP;
+    } else if (kind == "header" && !name.empty()) {
+        key.source = KISLAYPHP_HASH_HEADER;
+    } else if (kind == "cookie" && !name.empty()) {
+        key.source = KISLAYPHP_HASH_COOKIE;
+    } else if (kind == "param" && !name.empty()) {
+        key.source = KISLAYPHP_HASH_PARAM;
+    } else if (kind == "segment" && !name.empty() && name.find_first_not_of("0123456789") == std::string::npos) {
+        key.source = KISLAYPHP_HASH_SEGMENT;
+        key.segment = static_cast<size_t>(std::strtoul(name.c_str(), nullptr, 10));
+        if (key.segment == 0) {
+            return false;
+        }
     } else {
-        hostport = value.substr(0, slash);
-        base_path = value.substr(slash);
-    }
-
-    if (hostport.empty()) {
         return false;
     }
+    key.name = name;
+    key.spec = spec;
+    return true;
+}
 
-    std::string host = hostport;
-    int port = 80;
-    size_t colon = hostport.find(':');
-    if (colon != std::string::npos) {
-        host = hostport.substr(0, colon);
-        std::string port_str = hostport.substr(colon + 1);
-        if (port_str.empty()) {
-            return false;
-        }
-        port = std::atoi(port_str.c_str());
-        if (port <= 0) {
+// Applies a "balancer" or "hash_key" option, shared by route options and
+// registerService().
+static bool kislayphp_apply_balancing_option(const std::string &option,
+                                             zval *value,
+                                             kislayphp_balancing &balancing,
+                                             std::string &error) {
+    if (option == "balancer") {
+        if (Z_TYPE_P(value) != IS_STRING ||
+            !kislayphp_balancer_from(std::string(Z_STRVAL_P(value), Z_STRLEN_P(value)), balancing.balancer)) {
+            error = "Unknown balancer (expected round_robin, least_conn, p2c, peak_ewma or maglev)";
             return false;
         }
+        return true;
     }
-
-    route.host = host;
-    route.port = port;
-    route.base_path = base_path;
-    return true;
-}
-
-static bool kislayphp_call_php(zval *callable, uint32_t argc, zval *argv, zval *retval) {
-    ZVAL_UNDEF(retval);
-    if (call_user_function(EG(function_table), nullptr, callable, retval, argc, argv) == FAILURE) {
+    if (Z_TYPE_P(value) != IS_STRING ||
+        !kislayphp_hash_key_from(std::string(Z_STRVAL_P(value), Z_STRLEN_P(value)), balancing.hash_key)) {
+        error = "Invalid hash_key (expected ip, header:<name>, cookie:<name>, segment:<n> or param:<name>)";
         return false;
     }
     return true;
 }
 
-static void kislayphp_send_error(struct mg_connection *conn, int status, const char *message) {
-    const char *status_text = "Error";
-    if (status == 404) {
-        status_text = "Not Found";
-    } else if (status == 413) {
-        status_text = "Payload Too Large";
-    } else if (status == 502) {
-        status_text = "Bad Gateway";
+static uint64_t kislayphp_hash_bytes(const char *data, size_t len, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
     }
-    mg_printf(conn,
-              "HTTP/1.1 %d %s\r\n"
-              "Content-Type: text/plain; charset=utf-8\r\n"
-              "Content-Length: %zu\r\n"
-              "Connection: close\r\n\r\n"
-              "%s",
-              status,
-              status_text,
-              std::strlen(message),
-              message);
+    // Final avalanche so nearby keys land far apart in the table.
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
 }
 
-static bool kislayphp_proxy_request(struct mg_connection *conn,
-                                    const struct mg_request_info *info,
-                                    const kislayphp_gateway_route &route,
-                                    size_t max_body_bytes) {
-    if (max_body_bytes > 0 && info->content_length > static_cast<long long>(max_body_bytes)) {
-        kislayphp_send_error(conn, 413, "Payload Too Large");
-        return false;
+// Builds the Maglev lookup table (Eisenbud et al., NSDI '16). Each endpoint
+// walks its own permutation of the slots, derived from its target string,
+// and endpoints take turns claiming their next free slot. Adding or
+// removing one of N endpoints moves roughly 1/N of the slots.
+static void kislayphp_build_maglev(kislayphp_target_set &set) {
+    set.maglev.clear();
+    size_t count = set.endpoints.size();
+    if (set.balancing.balancer != KISLAYPHP_BALANCE_MAGLEV || count < 2) {
+        return;
     }
-    char error_buf[256] = {0};
-    struct mg_connection *target = mg_connect_client(route.host.c_str(), route.port, 0, error_buf, sizeof(error_buf));
-    if (target == nullptr) {
-        kislayphp_send_error(conn, 502, "Upstream connect failed");
-        return false;
+    // The slot count must not change with the endpoint count or every key
+    // would remap, so it only grows past 40 endpoints (~100 slots each).
+    static const size_t primes[] = {4093, 8191, 16381, 32749, 65521};
+    size_t size = primes[sizeof(primes) / sizeof(primes[0]) - 1];
+    for (size_t prime : primes) {
+        if (prime >= count * 100) {
+            size = prime;
+            break;
+        }
     }
 
-    std::string path = info->local_uri ? info->local_uri : (info->request_uri ? info->request_uri : "/");
-    std::string target_path = kislayphp_join_paths(route.base_path, path);
-    if (info->query_string && *info->query_string) {
-        target_path.append("?");
-        target_path.append(info->query_string);
+    std::vector<size_t> offset(count);
+    std::vector<size_t> skip(count);
+    std::vector<size_t> next(count, 0);
+    for (size_t i = 0; i < count; ++i) {
+        const std::string &name = set.endpoints[i].target;
+        offset[i] = kislayphp_hash_bytes(name.data(), name.size(), 0) % size;
+        skip[i] = kislayphp_hash_bytes(name.data(), name.size(), 0x5bd1e995) % (size - 1) + 1;
     }
-
-    std::string method = info->request_method ? info->request_method : "GET";
-    mg_printf(target, "%s %s HTTP/1.0\r\n", method.c_str(), target_path.c_str());
-    mg_printf(target, "Host: %s:%d\r\n", route.host.c_str(), route.port);
-    mg_printf(target, "Connection: close\r\n");
-
-    bool has_content_length = false;
-    for (int i = 0; i < info->num_headers; ++i) {
-        const char *name = info->http_headers[i].name;
-        const char *value = info->http_headers[i].value;
-        if (name == nullptr || value == nullptr) {
-            continue;
-        }
-        if (::strcasecmp(name, "Host") == 0 || kislayphp_is_hop_header(name)) {
-            continue;
-        }
-        if (::strcasecmp(name, "Content-Length") == 0) {
-            has_content_length = true;
+    std::vector<int32_t> table(size, -1);
+    size_t filled = 0;
+    while (true) {
+        for (size_t i = 0; i < count; ++i) {
+            size_t slot = (offset[i] + next[i] * skip[i]) % size;
+            while (table[slot] >= 0) {
+                ++next[i];
+                slot = (offset[i] + next[i] * skip[i]) % size;
+            }
+            table[slot] = static_cast<int32_t>(i);
+            ++next[i];
+            if (++filled == size) {
+                set.maglev.assign(table.begin(), table.end());
+                return;
+            }
         }
-        mg_printf(target, "%s: %s\r\n", name, value);
     }
+}
 
-    if (!has_content_length && info->content_length >= 0) {
-        mg_printf(target, "Content-Length: %lld\r\n", static_cast<long long>(info->content_length));
+static uint64_t kislayphp_random() {
+    thread_local uint64_t state = 0;
+    if (state == 0) {
+        state = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^
+                reinterpret_cast<uintptr_t>(&state) ^ 0x9e3779b97f4a7c15ULL;
     }
-    mg_printf(target, "\r\n");
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
 
-    if (info->content_length > 0) {
-        std::vector<char> body(static_cast<size_t>(info->content_length));
-        size_t read_total = 0;
-        while (read_total < body.size()) {
-            int read_now = mg_read(conn, body.data() + read_total, body.size() - read_total);
-            if (read_now <= 0) {
-                break;
-            }
-            read_total += static_cast<size_t>(read_now);
+static int64_t kislayphp_endpoint_load(const kislayphp_endpoint &endpoint) {
+    return endpoint.upstream != nullptr ? endpoint.upstream->in_flight.load(std::memory_order_relaxed) : 0;
+}
+
+static int64_t kislayphp_now_ns() {
+    return static_cast<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static int64_t kislayphp_wall_ms() {
+    return static_cast<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+static size_t kislayphp_disk_chunk_bytes(uint8_t slab_class) {
+    return static_cast<size_t>(1024) << slab_class;
+}
+
+static uint8_t *kislayphp_disk_page_table(kislayphp_disk_tier &tier) {
+    return reinterpret_cast<uint8_t *>(tier.base + KISLAYPHP_DISK_TABLE_OFFSET);
+}
+
+static kislayphp_disk_record *kislayphp_disk_record_at(kislayphp_disk_tier &tier, uint64_t offset) {
+    return reinterpret_cast<kislayphp_disk_record *>(tier.base + offset);
+}
+
+static size_t kislayphp_disk_page_shard(const kislayphp_disk_tier &tier, uint64_t page) {
+    return static_cast<size_t>((page - 1) % tier.shards.size());
+}
+
+static uint64_t kislayphp_fnv1a(uint64_t hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Stable across processes, unlike std::hash, as records are found again
+// by the shard of their page.
+static size_t kislayphp_disk_key_shard(const kislayphp_disk_tier &tier, const std::string &key) {
+    return static_cast<size_t>(kislayphp_fnv1a(14695981039346656037ULL, key.data(), key.size()) % tier.shards.size());
+}
+
+// FNV-1a over a record's head fields (all but magic and checksum) and its
+// payload of payload_len bytes.
+static uint64_t kislayphp_disk_checksum(const kislayphp_disk_record &record, size_t payload_len) {
+    const char *head = reinterpret_cast<const char *>(&record.key_len);
+    uint64_t hash = kislayphp_fnv1a(14695981039346656037ULL, head,
+                                    offsetof(kislayphp_disk_record, checksum) - offsetof(kislayphp_disk_record, key_len));
+    return kislayphp_fnv1a(hash, reinterpret_cast<const char *>(&record + 1), payload_len);
+}
+
+// Nanoseconds from wall_ms to at_ms, limited to a century either way so
+// that far-off stored times cannot overflow.
+static int64_t kislayphp_disk_span_ns(int64_t wall_ms, int64_t at_ms) {
+    const int64_t century_ms = 3155760000000LL;
+    at_ms = std::min(std::max(at_ms, wall_ms - century_ms), wall_ms + century_ms);
+    return (at_ms - wall_ms) * 1000000;
+}
+
+static void kislayphp_disk_put_u32(std::string &out, uint32_t value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void kislayphp_disk_put_string(std::string &out, const std::string &value) {
+    kislayphp_disk_put_u32(out, static_cast<uint32_t>(value.size()));
+    out.append(value);
+}
+
+// Bounds-checked reader of serialised entry metadata.
+struct kislayphp_disk_reader {
+    const char *at;
+    const char *end;
+    bool ok = true;
+
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (static_cast<size_t>(end - at) < sizeof(value)) {
+            ok = false;
+            return 0;
         }
-        if (read_total > 0) {
-            mg_write(target, body.data(), read_total);
+        std::memcpy(&value, at, sizeof(value));
+        at += sizeof(value);
+        return value;
+    }
+
+    std::string string() {
+        uint32_t len = u32();
+        if (!ok || static_cast<size_t>(end - at) < len) {
+            ok = false;
+            return std::string();
         }
+        std::string value(at, len);
+        at += len;
+        return value;
     }
+};
 
-    if (mg_get_response(target, error_buf, sizeof(error_buf), 10000) < 0) {
-        mg_close_connection(target);
-        kislayphp_send_error(conn, 502, "Upstream response failed");
-        return false;
+static std::string kislayphp_disk_meta(const kislayphp_cache_entry &entry) {
+    std::string meta;
+    kislayphp_disk_put_u32(meta, static_cast<uint32_t>(entry.head_len));
+    kislayphp_disk_put_u32(meta, static_cast<uint32_t>(entry.age_offset));
+    kislayphp_disk_put_u32(meta, static_cast<uint32_t>(entry.status));
+    kislayphp_disk_put_u32(meta, static_cast<uint32_t>(std::min<long long>(entry.initial_age, UINT32_MAX)));
+    kislayphp_disk_put_u32(meta, static_cast<uint32_t>(entry.vary.size()));
+    for (const auto &vary : entry.vary) {
+        kislayphp_disk_put_string(meta, vary.first);
+        kislayphp_disk_put_string(meta, vary.second);
     }
+    kislayphp_disk_put_string(meta, entry.etag);
+    kislayphp_disk_put_string(meta, entry.last_modified);
+    kislayphp_disk_put_u32(meta, static_cast<uint32_t>(entry.tags.size()));
+    for (const auto &tag : entry.tags) {
+        kislayphp_disk_put_string(meta, tag);
+    }
+    return meta;
+}
 
-    const struct mg_response_info *resp_info = mg_get_response_info(target);
-    int status_code = resp_info ? resp_info->status_code : 502;
-    const char *status_text = (resp_info && resp_info->status_text) ? resp_info->status_text : "Bad Gateway";
-    mg_printf(conn, "HTTP/1.1 %d %s\r\n", status_code, status_text);
+// Decodes the record at offset into key and entry, without its blob.
+// Stored times are moved onto this process's steady clock.
+static bool kislayphp_disk_decode(kislayphp_disk_tier &tier,
+                                  uint64_t offset,
+                                  std::string &key,
+                                  kislayphp_cache_entry &entry,
+                                  int64_t now_ns,
+                                  int64_t wall_ms) {
+    const kislayphp_disk_record *record = kislayphp_disk_record_at(tier, offset);
+    const char *payload = reinterpret_cast<const char *>(record + 1);
+    key.assign(payload, record->key_len);
+    kislayphp_disk_reader reader{payload + record->key_len, payload + record->key_len + record->meta_len};
+    entry.head_len = reader.u32();
+    entry.age_offset = reader.u32();
+    entry.status = static_cast<int>(reader.u32());
+    entry.initial_age = reader.u32();
+    entry.vary.resize(reader.ok ? std::min<uint32_t>(reader.u32(), 64) : 0);
+    for (auto &vary : entry.vary) {
+        vary.first = reader.string();
+        vary.second = reader.string();
+    }
+    entry.etag = reader.string();
+    entry.last_modified = reader.string();
+    entry.tags.resize(reader.ok ? std::min<uint32_t>(reader.u32(), 1024) : 0);
+    for (auto &tag : entry.tags) {
+        tag = reader.string();
+    }
+    entry.stored_ns = now_ns + kislayphp_disk_span_ns(wall_ms, record->stored_ms);
+    entry.expires_ns = now_ns + kislayphp_disk_span_ns(wall_ms, record->expires_ms);
+    return reader.ok && entry.head_len <= record->blob_len && entry.age_offset + 10 <= entry.head_len;
+}
 
-    bool resp_has_length = false;
-    if (resp_info) {
-        for (int i = 0; i < resp_info->num_headers; ++i) {
-            const char *name = resp_info->http_headers[i].name;
-            const char *value = resp_info->http_headers[i].value;
-            if (name == nullptr || value == nullptr) {
-                continue;
+static void kislayphp_disk_index(kislayphp_disk_shard &shard,
+                                 const std::string &key,
+                                 const kislayphp_cache_entry &entry,
+                                 uint64_t offset) {
+    shard.index[key].push_back(kislayphp_disk_variant{offset, entry.vary});
+    for (const auto &tag : entry.tags) {
+        shard.tags[tag].insert(offset);
+    }
+    ++shard.entries;
+}
+
+// Removes the record at offset from its shard's index and frees its chunk.
+static void kislayphp_disk_release(kislayphp_disk_tier &tier, kislayphp_disk_shard &shard, uint64_t offset) {
+    std::string key;
+    kislayphp_cache_entry entry;
+    kislayphp_disk_decode(tier, offset, key, entry, 0, 0);
+    auto indexed = shard.index.find(key);
+    if (indexed != shard.index.end()) {
+        auto &variants = indexed->second;
+        variants.erase(std::remove_if(variants.begin(), variants.end(),
+                                      [offset](const kislayphp_disk_variant &variant) {
+                                          return variant.offset == offset;
+                                      }),
+                       variants.end());
+        if (variants.empty()) {
+            shard.index.erase(indexed);
+        }
+    }
+    for (const auto &tag : entry.tags) {
+        auto tagged = shard.tags.find(tag);
+        if (tagged != shard.tags.end()) {
+            tagged->second.erase(offset);
+            if (tagged->second.empty()) {
+                shard.tags.erase(tagged);
             }
-            if (kislayphp_is_hop_header(name)) {
+        }
+    }
+    kislayphp_disk_record_at(tier, offset)->magic = 0;
+    uint8_t slab_class = kislayphp_disk_page_table(tier)[offset / KISLAYPHP_DISK_PAGE_BYTES - 1];
+    shard.classes[slab_class].free.push_back(offset);
+    --shard.entries;
+}
+
+// Rebuilds the in-memory index from the page table and the records. Chunks
+// whose record is torn or corrupt, or sits in another shard's page, are
+// freed.
+static void kislayphp_disk_load(kislayphp_disk_tier &tier) {
+    uint8_t *table = kislayphp_disk_page_table(tier);
+    int64_t now_ns = kislayphp_now_ns();
+    int64_t wall_ms = kislayphp_wall_ms();
+    for (uint64_t page = 1; page <= tier.page_count; ++page) {
+        size_t shard_index = kislayphp_disk_page_shard(tier, page);
+        kislayphp_disk_shard &shard = *tier.shards[shard_index];
+        uint8_t slab_class = table[page - 1];
+        if (slab_class >= KISLAYPHP_DISK_CLASSES) {
+            table[page - 1] = KISLAYPHP_DISK_UNASSIGNED;
+            shard.unassigned.push_back(page);
+            continue;
+        }
+        shard.classes[slab_class].pages.push_back(page);
+        size_t chunk = kislayphp_disk_chunk_bytes(slab_class);
+        for (size_t at = 0; at < KISLAYPHP_DISK_PAGE_BYTES; at += chunk) {
+            uint64_t offset = page * KISLAYPHP_DISK_PAGE_BYTES + at;
+            kislayphp_disk_record *record = kislayphp_disk_record_at(tier, offset);
+            uint64_t payload = static_cast<uint64_t>(record->key_len) + record->meta_len + record->blob_len;
+            std::string key;
+            kislayphp_cache_entry entry;
+            if (record->magic == KISLAYPHP_DISK_RECORD_MAGIC && payload <= chunk - sizeof(kislayphp_disk_record) &&
+                record->checksum == kislayphp_disk_checksum(*record, payload) &&
+                kislayphp_disk_decode(tier, offset, key, entry, now_ns, wall_ms) &&
+                kislayphp_disk_key_shard(tier, key) == shard_index) {
+                kislayphp_disk_index(shard, key, entry, offset);
                 continue;
             }
-            if (::strcasecmp(name, "Content-Length") == 0) {
-                resp_has_length = true;
+            record->magic = 0;
+            shard.classes[slab_class].free.push_back(offset);
+        }
+    }
+}
+
+// Opens, or creates, the cache file at path. A cache file laid out for
+// another size or version is emptied and laid out again; any other
+// non-empty file is refused rather than overwritten.
+static std::unique_ptr<kislayphp_disk_tier> kislayphp_disk_open(const std::string &path, size_t max_bytes, std::string &error) {
+    uint64_t page_count = max_bytes / KISLAYPHP_DISK_PAGE_BYTES;
+    if (page_count < 2) {
+        error = "Cache file must be at least 2 MiB";
+        return nullptr;
+    }
+    page_count = std::min<uint64_t>(page_count - 1, KISLAYPHP_DISK_PAGE_BYTES - KISLAYPHP_DISK_TABLE_OFFSET);
+
+    std::unique_ptr<kislayphp_disk_tier> tier(new kislayphp_disk_tier());
+    tier->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (tier->fd < 0) {
+        error = "Cannot open cache file " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    if (::flock(tier->fd, LOCK_EX | LOCK_NB) != 0) {
+        error = "Cache file " + path + " is in use";
+        return nullptr;
+    }
+    tier->page_count = page_count;
+    tier->size = static_cast<size_t>((page_count + 1) * KISLAYPHP_DISK_PAGE_BYTES);
+    tier->shards.resize(static_cast<size_t>(std::min<uint64_t>(page_count, KISLAYPHP_DISK_SHARDS)));
+    for (auto &shard : tier->shards) {
+        shard.reset(new kislayphp_disk_shard());
+    }
+    struct stat st;
+    if (::fstat(tier->fd, &st) != 0) {
+        error = "Cannot stat cache file " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    kislayphp_disk_header header;
+    std::memset(&header, 0, sizeof(header));
+    bool ours = st.st_size == 0 ||
+                (::pread(tier->fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+                 header.magic == KISLAYPHP_DISK_MAGIC);
+    if (!ours) {
+        error = "File " + path + " is not a gateway cache file";
+        return nullptr;
+    }
+    bool reuse = static_cast<size_t>(st.st_size) == tier->size && header.version == KISLAYPHP_DISK_VERSION &&
+                 header.page_bytes == KISLAYPHP_DISK_PAGE_BYTES && header.page_count == page_count;
+    if (!reuse && ::ftruncate(tier->fd, 0) != 0) {
+        error = "Cannot size cache file " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    // Records are written through the mapping, where running out of disk
+    // space would raise SIGBUS, so every block is reserved up front. A
+    // reused file may still be sparse.
+    int reserved = ::posix_fallocate(tier->fd, 0, static_cast<off_t>(tier->size));
+    if (reserved != 0) {
+        error = "Cannot reserve space for cache file " + path + ": " + std::strerror(reserved);
+        return nullptr;
+    }
+    void *base = ::mmap(nullptr, tier->size, PROT_READ | PROT_WRITE, MAP_SHARED, tier->fd, 0);
+    if (base == MAP_FAILED) {
+        error = "Cannot map cache file " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    tier->base = static_cast<char *>(base);
+    if (!reuse) {
+        std::memset(kislayphp_disk_page_table(*tier), KISLAYPHP_DISK_UNASSIGNED, static_cast<size_t>(page_count));
+        header.magic = KISLAYPHP_DISK_MAGIC;
+        header.version = KISLAYPHP_DISK_VERSION;
+        header.page_bytes = static_cast<uint32_t>(KISLAYPHP_DISK_PAGE_BYTES);
+        header.page_count = page_count;
+        std::memcpy(tier->base, &header, sizeof(header));
+    }
+    kislayphp_disk_load(*tier);
+    return tier;
+}
+
+// Folds one latency sample into the upstream's peak-EWMA: a slower sample
+// replaces the average outright, faster ones are blended in with a weight
+// that grows with the time since the previous sample. Concurrent samples
+// may overwrite each other, which only loses a sample.
+static void kislayphp_observe_latency(kislayphp_upstream *upstream, int64_t sample_ns, int64_t now_ns) {
+    double sample = static_cast<double>(sample_ns);
+    double previous = upstream->latency_ewma.load(std::memory_order_relaxed);
+    int64_t stamp = upstream->latency_stamp.exchange(now_ns, std::memory_order_relaxed);
+    double next = sample;
+    if (stamp != 0 && sample < previous) {
+        double elapsed = static_cast<double>(std::max<int64_t>(now_ns - stamp, 0));
+        double weight = std::exp(-elapsed / upstream->latency_decay_ns);
+        next = previous * weight + sample * (1.0 - weight);
+    }
+    upstream->latency_ewma.store(next, std::memory_order_relaxed);
+}
+
+static size_t kislayphp_latency_bucket(uint64_t us) {
+    if (us < 4) {
+        return static_cast<size_t>(us);
+    }
+    int exponent = 63 - __builtin_clzll(us);
+    size_t index = static_cast<size_t>(exponent) * 4 + ((us >> (exponent - 2)) & 3);
+    return std::min(index, KISLAYPHP_LATENCY_BUCKETS - 1);
+}
+
+// Upper bound, in microseconds, of the latencies counted in a bucket.
+static uint64_t kislayphp_latency_bucket_limit(size_t index) {
+    if (index < 8) {
+        return index + 1;
+    }
+    return static_cast<uint64_t>(5 + index % 4) << (index / 4 - 2);
+}
+
+static void kislayphp_latency_record(kislayphp_latency_histogram &histogram, int64_t sample_ns) {
+    uint64_t us = static_cast<uint64_t>(std::max<int64_t>(sample_ns, 0)) / 1000;
+    histogram.buckets[kislayphp_latency_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    if (histogram.samples.fetch_add(1, std::memory_order_relaxed) + 1 != KISLAYPHP_LATENCY_WINDOW) {
+        return;
+    }
+    for (auto &bucket : histogram.buckets) {
+        bucket.fetch_sub(bucket.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    }
+    histogram.samples.fetch_sub(KISLAYPHP_LATENCY_WINDOW / 2, std::memory_order_relaxed);
+}
+
+// Latency below which the given percentage of recent samples fell, in
+// microseconds, or 0 while there are too few samples to tell.
+static uint64_t kislayphp_latency_percentile(const kislayphp_latency_histogram &histogram, double percentile) {
+    uint32_t counts[KISLAYPHP_LATENCY_BUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < KISLAYPHP_LATENCY_BUCKETS; ++i) {
+        counts[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total < KISLAYPHP_HEDGE_MIN_SAMPLES) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(static_cast<double>(total) * percentile / 100.0));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < KISLAYPHP_LATENCY_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return kislayphp_latency_bucket_limit(i);
+        }
+    }
+    return kislayphp_latency_bucket_limit(KISLAYPHP_LATENCY_BUCKETS - 1);
+}
+
+// Expected cost of sending one more request: the latency average, decayed
+// towards zero while no samples arrive so a backend that was slow gets
+// probed again, times the requests it already has. An unmeasured backend
+// is free until it has a request outstanding.
+static double kislayphp_endpoint_cost(const kislayphp_endpoint &endpoint, int64_t now_ns) {
+    const kislayphp_upstream *upstream = endpoint.upstream;
+    if (upstream == nullptr) {
+        return 0.0;
+    }
+    int64_t in_flight = upstream->in_flight.load(std::memory_order_relaxed);
+    int64_t stamp = upstream->latency_stamp.load(std::memory_order_relaxed);
+    if (stamp == 0) {
+        return in_flight > 0 ? 1e18 + static_cast<double>(in_flight) : 0.0;
+    }
+    double elapsed = static_cast<double>(std::max<int64_t>(now_ns - stamp, 0));
+    double latency = upstream->latency_ewma.load(std::memory_order_relaxed) *
+                     std::exp(-elapsed / upstream->latency_decay_ns);
+    return latency * static_cast<double>(in_flight + 1);
+}
+
+static void kislayphp_breaker_open(kislayphp_breaker &breaker, const kislayphp_breaker_config &config, int64_t now_ns) {
+    breaker.retry_at.store(now_ns + static_cast<int64_t>(config.open_ms) * 1000000, std::memory_order_relaxed);
+    breaker.failures.store(0, std::memory_order_relaxed);
+    breaker.state.store(KISLAYPHP_BREAKER_OPEN, std::memory_order_release);
+    breaker.opened.fetch_add(1, std::memory_order_relaxed);
+}
+
+// One request's pass through a circuit breaker. acquire() refuses while the
+// breaker is open; once open_ms has passed it turns half-open and admits up
+// to half_open_requests concurrent probes. A probe that ends without an
+// outcome (e.g. the client body was too large) just frees its slot. A probe
+// that outlives its half-open period is ignored.
+struct kislayphp_breaker_permit {
+    kislayphp_breaker *breaker = nullptr;
+    // Copied, as a hedge attempt can record its outcome after the request
+    // (and the route table it came from) is gone.
+    kislayphp_breaker_config config;
+    bool probe = false;
+    uint64_t cycle = 0;
+
+    bool acquire(kislayphp_breaker *target, const kislayphp_breaker_config &settings, int64_t now_ns) {
+        if (target->state.load(std::memory_order_acquire) != KISLAYPHP_BREAKER_CLOSED) {
+            std::lock_guard<std::mutex> guard(target->lock);
+            int state = target->state.load(std::memory_order_relaxed);
+            if (state == KISLAYPHP_BREAKER_OPEN) {
+                if (now_ns < target->retry_at.load(std::memory_order_relaxed)) {
+                    return false;
+                }
+                ++target->cycle;
+                target->probes = 0;
+                target->successes = 0;
+                target->state.store(KISLAYPHP_BREAKER_HALF_OPEN, std::memory_order_release);
+                state = KISLAYPHP_BREAKER_HALF_OPEN;
+            }
+            if (state == KISLAYPHP_BREAKER_HALF_OPEN) {
+                if (target->probes >= settings.half_open_requests) {
+                    return false;
+                }
+                ++target->probes;
+                probe = true;
+                cycle = target->cycle;
             }
-            mg_printf(conn, "%s: %s\r\n", name, value);
         }
-        if (!resp_has_length && resp_info->content_length >= 0) {
-            mg_printf(conn, "Content-Length: %lld\r\n", resp_info->content_length);
+        breaker = target;
+        config = settings;
+        return true;
+    }
+
+    void record(bool failed, int64_t now_ns) {
+        if (breaker == nullptr) {
+            return;
+        }
+        kislayphp_breaker &target = *breaker;
+        breaker = nullptr;
+        if (!probe) {
+            // Outcomes of requests admitted before the breaker tripped are
+            // ignored once it has left the closed state.
+            if (target.state.load(std::memory_order_acquire) != KISLAYPHP_BREAKER_CLOSED) {
+                return;
+            }
+            if (!failed) {
+                if (target.failures.load(std::memory_order_relaxed) != 0) {
+                    target.failures.store(0, std::memory_order_relaxed);
+                }
+                return;
+            }
+            if (target.failures.fetch_add(1, std::memory_order_relaxed) + 1 < config.failures) {
+                return;
+            }
+            std::lock_guard<std::mutex> guard(target.lock);
+            if (target.state.load(std::memory_order_relaxed) == KISLAYPHP_BREAKER_CLOSED) {
+                kislayphp_breaker_open(target, config, now_ns);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> guard(target.lock);
+        if (target.cycle != cycle) {
+            return;
+        }
+        --target.probes;
+        if (target.state.load(std::memory_order_relaxed) != KISLAYPHP_BREAKER_HALF_OPEN) {
+            return;
+        }
+        if (failed) {
+            kislayphp_breaker_open(target, config, now_ns);
+        } else if (++target.successes >= config.half_open_requests) {
+            target.failures.store(0, std::memory_order_relaxed);
+            target.state.store(KISLAYPHP_BREAKER_CLOSED, std::memory_order_release);
         }
     }
-    mg_printf(conn, "Connection: close\r\n\r\n");
 
-    char buffer[4096];
-    int read_len = 0;
-    while ((read_len = mg_read(target, buffer, sizeof(buffer))) > 0) {
-        mg_write(conn, buffer, static_cast<size_t>(read_len));
+    ~kislayphp_breaker_permit() {
+        if (breaker != nullptr && probe) {
+            std::lock_guard<std::mutex> guard(breaker->lock);
+            if (breaker->cycle == cycle) {
+                --breaker->probes;
+            }
+        }
     }
+};
 
-    mg_close_connection(target);
-    return true;
+static const char *kislayphp_breaker_state_name(const kislayphp_breaker &breaker) {
+    switch (breaker.state.load(std::memory_order_relaxed)) {
+        case KISLAYPHP_BREAKER_OPEN:
+            return "open";
+        case KISLAYPHP_BREAKER_HALF_OPEN:
+            return "half_open";
+        default:
+            return "closed";
+    }
 }
 
-static int kislayphp_gateway_begin_request(struct mg_connection *conn) {
-    const struct mg_request_info *info = mg_get_request_info(conn);
-    if (info == nullptr || info->user_data == nullptr) {
-        return 0;
+// Feeds one exchange into passive outlier detection. Reaching the
+// consecutive error limit ejects the upstream for base * 2^streak (capped);
+// the streak resets once the upstream has stayed in for a full max period.
+static void kislayphp_record_outcome(php_kislayphp_gateway_t *gateway, kislayphp_upstream *upstream, bool failed) {
+    if (gateway->outlier_errors == 0) {
+        return;
+    }
+    if (!failed) {
+        if (upstream->consecutive_errors.load(std::memory_order_relaxed) != 0) {
+            upstream->consecutive_errors.store(0, std::memory_order_relaxed);
+        }
+        return;
     }
+    if (upstream->consecutive_errors.fetch_add(1, std::memory_order_relaxed) + 1 < gateway->outlier_errors) {
+        return;
+    }
+    int64_t now_ns = kislayphp_now_ns();
+    int64_t until = upstream->ejected_until.load(std::memory_order_relaxed);
+    if (until > now_ns) {
+        return;
+    }
+    int64_t max_ns = static_cast<int64_t>(gateway->outlier_max_ms) * 1000000;
+    uint32_t streak = until != 0 && now_ns - until > max_ns ? 0 : upstream->ejection_streak.load(std::memory_order_relaxed);
+    int64_t duration = static_cast<int64_t>(gateway->outlier_base_ms) * 1000000;
+    for (uint32_t i = 0; i < streak && duration < max_ns; ++i) {
+        duration *= 2;
+    }
+    // Only the thread that wins the exchange ejects; racing failures
+    // from the same burst must not stack up the streak.
+    if (!upstream->ejected_until.compare_exchange_strong(until, now_ns + std::min(duration, max_ns),
+                                                         std::memory_order_relaxed)) {
+        return;
+    }
+    upstream->ejection_streak.store(streak + 1, std::memory_order_relaxed);
+    upstream->consecutive_errors.store(0, std::memory_order_relaxed);
+    upstream->ejections.fetch_add(1, std::memory_order_relaxed);
+}
 
-    auto *gateway = static_cast<php_kislayphp_gateway_t *>(info->user_data);
-    std::string method = info->request_method ? info->request_method : "";
-    method = kislayphp_to_upper(method);
-    std::string path = info->local_uri ? info->local_uri : (info->request_uri ? info->request_uri : "");
+static void kislayphp_limit_reset(php_kislayphp_gateway_t *gateway, kislayphp_upstream *upstream) {
+    std::lock_guard<std::mutex> guard(upstream->limit_lock);
+    upstream->limit = gateway->limit_max > 0 ? gateway->limit_initial : 0;
+    upstream->rtt_long_ns = 0;
+    upstream->limit_cut_at = 0;
+    upstream->concurrency_limit.store(static_cast<int64_t>(upstream->limit), std::memory_order_relaxed);
+}
 
-    kislayphp_gateway_route match;
-    bool found = false;
-    zval resolver;
-    ZVAL_UNDEF(&resolver);
-    bool has_resolver = false;
-    {
-        std::lock_guard<std::mutex> guard(gateway->lock);
-        for (const auto &route : gateway->routes) {
-            if (route.method == method && kislayphp_path_matches(route.path, path)) {
-                match = route;
-                found = true;
+// Takes an in-flight slot on the upstream. Over its concurrency limit the
+// request waits up to limit_queue_ms for a slot; false means it is to be
+// shed. in_flight receives the count including this request.
+static bool kislayphp_limit_acquire(php_kislayphp_gateway_t *gateway, kislayphp_upstream *upstream, int64_t &in_flight) {
+    if (upstream->concurrency_limit.load(std::memory_order_relaxed) == 0) {
+        in_flight = upstream->in_flight.fetch_add(1) + 1;
+        return true;
+    }
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(gateway->limit_queue_ms);
+    std::unique_lock<std::mutex> guard(upstream->limit_lock, std::defer_lock);
+    bool admitted = false;
+    bool timed_out = gateway->limit_queue_ms <= 0;
+    while (true) {
+        int64_t current = upstream->in_flight.load();
+        int64_t limit = upstream->concurrency_limit.load(std::memory_order_relaxed);
+        if (limit == 0 || current < limit) {
+            if (upstream->in_flight.compare_exchange_weak(current, current + 1)) {
+                in_flight = current + 1;
+                admitted = true;
                 break;
             }
+            continue;
         }
-        if (!found && gateway->has_fallback) {
-            match = gateway->fallback_route;
-            found = true;
+        if (timed_out) {
+            break;
         }
-        if (gateway->has_resolver) {
-            ZVAL_COPY(&resolver, &gateway->resolver);
-            has_resolver = true;
+        if (!guard.owns_lock()) {
+            // Registered before the slot count is read again under the
+            // lock, so a release in between cannot miss this waiter.
+            guard.lock();
+            upstream->limit_waiters.fetch_add(1);
+            continue;
         }
+        timed_out = upstream->limit_cv.wait_until(guard, until) == std::cv_status::timeout;
+    }
+    if (guard.owns_lock()) {
+        upstream->limit_waiters.fetch_sub(1);
     }
+    if (!admitted) {
+        gateway->limit_shed.fetch_add(1, std::memory_order_relaxed);
+    }
+    return admitted;
+}
 
-    if (!found) {
-        kislayphp_send_error(conn, 404, "Not Found");
-        return 1;
+static void kislayphp_limit_release(kislayphp_upstream *upstream) {
+    upstream->in_flight.fetch_sub(1);
+    if (upstream->limit_waiters.load() > 0) {
+        { std::lock_guard<std::mutex> guard(upstream->limit_lock); }
+        upstream->limit_cv.notify_one();
     }
+}
 
-    if (match.use_service) {
-        if (!has_resolver) {
-            kislayphp_send_error(conn, 502, "Service resolver not configured");
-            return 1;
+// Gradient controller on the time to the response head, after Netflix's
+// concurrency-limits (Gradient2). While a response comes back within
+// limit_tolerance of the upstream's long-run average latency the limit
+// grows by about its square root; an inflated latency scales it down by
+// the ratio. Growth only counts when at least half the limit is in use.
+// A failure cuts the limit by limit_backoff, at most once per average
+// latency so one burst of failures only counts once.
+static void kislayphp_limit_update(php_kislayphp_gateway_t *gateway,
+                                   kislayphp_upstream *upstream,
+                                   int64_t rtt_ns,
+                                   bool dropped,
+                                   int64_t in_flight,
+                                   int64_t now_ns) {
+    if (upstream->concurrency_limit.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(upstream->limit_lock);
+    double limit = upstream->limit;
+    if (dropped) {
+        if (now_ns - upstream->limit_cut_at >= static_cast<int64_t>(upstream->rtt_long_ns)) {
+            limit = std::max<double>(limit * gateway->limit_backoff, gateway->limit_min);
+            upstream->limit_cut_at = now_ns;
         }
-        zval args[3];
-        ZVAL_STRING(&args[0], match.service.c_str());
-        ZVAL_STRING(&args[1], method.c_str());
-        ZVAL_STRING(&args[2], path.c_str());
-        zval retval;
-        bool ok = kislayphp_call_php(&resolver, 3, args, &retval);
-        zval_ptr_dtor(&args[0]);
-        zval_ptr_dtor(&args[1]);
-        zval_ptr_dtor(&args[2]);
-        if (has_resolver) {
-            zval_ptr_dtor(&resolver);
-        }
-        if (!ok || Z_TYPE(retval) != IS_STRING) {
-            if (ok) {
-                zval_ptr_dtor(&retval);
-            }
-            kislayphp_send_error(conn, 502, "Service resolver failed");
-            return 1;
+    } else {
+        double rtt = static_cast<double>(std::max<int64_t>(rtt_ns, 1));
+        double &average = upstream->rtt_long_ns;
+        average = average == 0 ? rtt : average + (rtt - average) * (2.0 / (KISLAYPHP_LIMIT_RTT_WINDOW + 1.0));
+        // Let the average recover quickly once a backlog has drained.
+        if (average > rtt * 2) {
+            average *= 0.95;
+        }
+        if (static_cast<double>(in_flight) * 2 >= limit) {
+            double gradient = std::max(0.5, std::min(1.0, gateway->limit_tolerance * average / rtt));
+            double target = limit * gradient + std::sqrt(limit);
+            limit = std::min<double>(std::max<double>(limit * 0.8 + target * 0.2, gateway->limit_min), gateway->limit_max);
+        }
+    }
+    upstream->limit = limit;
+    upstream->concurrency_limit.store(std::max<int64_t>(static_cast<int64_t>(limit), 1), std::memory_order_relaxed);
+}
+
+// Finds the bytes a consistent-hash balancer keys on without copying them.
+// Returns false when the request does not carry the key.
+static bool kislayphp_hash_key_value(const kislayphp_hash_key &key,
+                                     struct mg_connection *conn,
+                                     const struct mg_request_info *info,
+                                     const kislayphp_route_match &match,
+                                     const char *&data,
+                                     size_t &len) {
+    switch (key.source) {
+        case KISLAYPHP_HASH_IP:
+            data = info->remote_addr;
+            len = std::strlen(data);
+            return len > 0;
+        case KISLAYPHP_HASH_HEADER:
+            data = mg_get_header(conn, key.name.c_str());
+            if (data == nullptr) {
+                return false;
+            }
+            len = std::strlen(data);
+            return len > 0;
+        case KISLAYPHP_HASH_COOKIE: {
+            const char *cookies = mg_get_header(conn, "Cookie");
+            for (const char *p = cookies; p != nullptr && *p != '\0';) {
+                while (*p == ' ' || *p == ';') {
+                    ++p;
+                }
+                const char *end = std::strchr(p, ';');
+                size_t pair_len = end != nullptr ? static_cast<size_t>(end - p) : std::strlen(p);
+                if (pair_len > key.name.size() && p[key.name.size()] == '=' &&
+                    std::strncmp(p, key.name.c_str(), key.name.size()) == 0) {
+                    data = p + key.name.size() + 1;
+                    len = pair_len - key.name.size() - 1;
+                    return true;
+                }
+                p += pair_len;
+            }
+            return false;
+        }
+        case KISLAYPHP_HASH_SEGMENT: {
+            const char *p = match.path != nullptr ? match.path : (info->local_uri != nullptr ? info->local_uri : "");
+            for (size_t segment = 0;; ) {
+                while (*p == '/') {
+                    ++p;
+                }
+                if (*p == '\0') {
+                    return false;
+                }
+                const char *end = std::strchr(p, '/');
+                size_t segment_len = end != nullptr ? static_cast<size_t>(end - p) : std::strlen(p);
+                if (++segment == key.segment) {
+                    data = p;
+                    len = segment_len;
+                    return true;
+                }
+                p += segment_len;
+            }
         }
-        std::string target(Z_STRVAL(retval), Z_STRLEN(retval));
-        zval_ptr_dtor(&retval);
+        case KISLAYPHP_HASH_PARAM:
+            if (match.route == nullptr) {
+                return false;
+            }
+            for (size_t i = 0; i < match.param_count && i < match.route->param_names.size(); ++i) {
+                if (match.route->param_names[i] == key.name) {
+                    data = match.path + match.param_offset[i];
+                    len = match.param_length[i];
+                    return true;
+                }
+            }
+            return false;
+    }
+    return false;
+}
 
-        kislayphp_gateway_route resolved = match;
-        resolved.target = target;
-        resolved.use_service = false;
-        if (!kislayphp_parse_target(resolved.target, resolved)) {
-            kislayphp_send_error(conn, 502, "Invalid upstream target");
-            return 1;
+static bool kislayphp_endpoint_usable(const kislayphp_endpoint &endpoint, int64_t now_ns) {
+    const kislayphp_upstream *upstream = endpoint.upstream;
+    return upstream == nullptr ||
+           (upstream->healthy.load(std::memory_order_relaxed) &&
+            upstream->ejected_until.load(std::memory_order_relaxed) <= now_ns &&
+            (upstream->breaker.state.load(std::memory_order_relaxed) != KISLAYPHP_BREAKER_OPEN ||
+             upstream->breaker.retry_at.load(std::memory_order_relaxed) <= now_ns) &&
+            (upstream->concurrency_limit.load(std::memory_order_relaxed) == 0 ||
+             upstream->in_flight.load(std::memory_order_relaxed) <
+                 upstream->concurrency_limit.load(std::memory_order_relaxed)));
+}
+
+// Picks the endpoint for one request. Lock-free: balancers only read the
+// per-upstream counters and bump the set's rotation counter. Unhealthy and
+// ejected endpoints are skipped unless that leaves none, in which case
+// traffic is spread over all of them rather than failed outright.
+// Upstreams at their concurrency limit are skipped the same way.
+// Maglev requests without their hash key fall back to round robin.
+// Upstreams listed in avoid (those a retry already failed on) count as
+// unusable too.
+static const kislayphp_endpoint &kislayphp_pick_endpoint(kislayphp_target_set &set,
+                                                         struct mg_connection *conn,
+                                                         const struct mg_request_info *info,
+                                                         const kislayphp_route_match &match,
+                                                         const kislayphp_upstream *const *avoid = nullptr,
+                                                         size_t avoid_count = 0) {
+    size_t count = set.endpoints.size();
+    if (count == 1) {
+        return set.endpoints[0];
+    }
+    int64_t now_ns = kislayphp_now_ns();
+    auto usable_at = [&set, now_ns, avoid, avoid_count](size_t index) {
+        const kislayphp_endpoint &endpoint = set.endpoints[index];
+        return kislayphp_endpoint_usable(endpoint, now_ns) &&
+               std::find(avoid, avoid + avoid_count, endpoint.upstream) == avoid + avoid_count;
+    };
+    size_t usable = 0;
+    for (size_t index = 0; index < count; ++index) {
+        usable += usable_at(index) ? 1 : 0;
+    }
+    bool filter = usable != 0 && usable != count;
+    auto ok = [&usable_at, filter](size_t index) {
+        return !filter || usable_at(index);
+    };
+    // Rotates over the usable endpoints by rank so skipping one does not
+    // double the share of its neighbour.
+    auto rotate = [&set, &ok, count, filter, usable]() {
+        uint64_t turn = set.next.fetch_add(1, std::memory_order_relaxed);
+        if (!filter) {
+            return static_cast<size_t>(turn % count);
         }
-        kislayphp_proxy_request(conn, info, resolved, gateway->max_body_bytes);
-        return 1;
+        size_t rank = static_cast<size_t>(turn % usable);
+        size_t index = 0;
+        for (; index < count; ++index) {
+            if (ok(index) && rank-- == 0) {
+                break;
+            }
+        }
+        return index;
+    };
+    if (filter && usable == 1) {
+        return set.endpoints[rotate()];
+    }
+    switch (set.balancing.balancer) {
+        case KISLAYPHP_BALANCE_MAGLEV: {
+            const char *data = nullptr;
+            size_t len = 0;
+            if (set.maglev.empty() || !kislayphp_hash_key_value(set.balancing.hash_key, conn, info, match, data, len)) {
+                return set.endpoints[rotate()];
+            }
+            // Walking on from the key's slot keeps keys of an unhealthy
+            // endpoint spread over the others and sticky while it is out.
+            size_t slot = static_cast<size_t>(kislayphp_hash_bytes(data, len, 0) % set.maglev.size());
+            while (!ok(set.maglev[slot])) {
+                slot = (slot + 1) % set.maglev.size();
+            }
+            return set.endpoints[set.maglev[slot]];
+        }
+        case KISLAYPHP_BALANCE_PEAK_EWMA: {
+            size_t start = rotate();
+            size_t best = start;
+            double best_cost = kislayphp_endpoint_cost(set.endpoints[start], now_ns);
+            for (size_t i = 1; i < count; ++i) {
+                size_t index = (start + i) % count;
+                if (!ok(index)) {
+                    continue;
+                }
+                double cost = kislayphp_endpoint_cost(set.endpoints[index], now_ns);
+                if (cost < best_cost) {
+                    best = index;
+                    best_cost = cost;
+                }
+            }
+            return set.endpoints[best];
+        }
+        case KISLAYPHP_BALANCE_LEAST_CONN: {
+            // Start the scan at a rotating offset so ties spread evenly.
+            size_t start = rotate();
+            size_t best = start;
+            int64_t best_load = kislayphp_endpoint_load(set.endpoints[start]);
+            for (size_t i = 1; i < count && best_load > 0; ++i) {
+                size_t index = (start + i) % count;
+                if (!ok(index)) {
+                    continue;
+                }
+                int64_t load = kislayphp_endpoint_load(set.endpoints[index]);
+                if (load < best_load) {
+                    best = index;
+                    best_load = load;
+                }
+            }
+            return set.endpoints[best];
+        }
+        case KISLAYPHP_BALANCE_P2C: {
+            // Draw two distinct usable endpoints by rank among the usable ones.
+            size_t pool = filter ? usable : count;
+            size_t first_rank = static_cast<size_t>(kislayphp_random() % pool);
+            size_t second_rank = static_cast<size_t>(kislayphp_random() % (pool - 1));
+            if (second_rank >= first_rank) {
+                ++second_rank;
+            }
+            size_t first = first_rank;
+            size_t second = second_rank;
+            for (size_t index = 0, rank = 0; filter && index < count; ++index) {
+                if (!ok(index)) {
+                    continue;
+                }
+                if (rank == first_rank) {
+                    first = index;
+                }
+                if (rank == second_rank) {
+                    second = index;
+                }
+                ++rank;
+            }
+            return kislayphp_endpoint_load(set.endpoints[second]) < kislayphp_endpoint_load(set.endpoints[first])
+                ? set.endpoints[second]
+                : set.endpoints[first];
+        }
+        default:
+            return set.endpoints[rotate()];
+    }
+}
+
+static bool kislayphp_pool_acquire(php_kislayphp_gateway_t *gateway,
+                                   kislayphp_upstream *upstream,
+                                   bool allow_reuse,
+                                   kislayphp_upstream_lease &lease) {
+    lease.pool = nullptr;
+    lease.conn = nullptr;
+    lease.reused = false;
+    auto now = std::chrono::steady_clock::now();
+
+    if (gateway->pool_max_idle > 0) {
+        lease.pool = upstream;
+    }
+    if (lease.pool != nullptr && allow_reuse) {
+        std::vector<struct mg_connection *> expired;
+        {
+            std::lock_guard<std::mutex> guard(lease.pool->lock);
+            while (!lease.pool->idle.empty()) {
+                kislayphp_pooled_conn candidate = lease.pool->idle.back();
+                lease.pool->idle.pop_back();
+                auto idle_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - candidate.idle_since).count();
+                auto age_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - candidate.created_at).count();
+                if (idle_ms >= gateway->pool_idle_timeout_ms || age_ms >= gateway->pool_max_lifetime_ms) {
+                    expired.push_back(candidate.conn);
+                    continue;
+                }
+                lease.conn = candidate.conn;
+                lease.created_at = candidate.created_at;
+                lease.reused = true;
+                break;
+            }
+        }
+        for (struct mg_connection *stale : expired) {
+            mg_close_connection(stale);
+        }
+        if (lease.reused) {
+            gateway->pool_hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    char error_buf[256] = {0};
+    lease.conn = mg_connect_client(upstream->host.c_str(), upstream->port, 0, error_buf, sizeof(error_buf));
+    if (lease.conn == nullptr) {
+        return false;
+    }
+    lease.created_at = now;
+    gateway->pool_misses.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+static void kislayphp_pool_release(php_kislayphp_gateway_t *gateway, kislayphp_upstream_lease &lease, bool reusable) {
+    if (lease.conn == nullptr) {
+        return;
+    }
+    struct mg_connection *conn = lease.conn;
+    lease.conn = nullptr;
+    if (reusable && lease.pool != nullptr) {
+        auto now = std::chrono::steady_clock::now();
+        auto age_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - lease.created_at).count();
+        if (age_ms < gateway->pool_max_lifetime_ms) {
+            std::lock_guard<std::mutex> guard(lease.pool->lock);
+            if (lease.pool->idle.size() < gateway->pool_max_idle) {
+                lease.pool->idle.push_back(kislayphp_pooled_conn{conn, lease.created_at, now});
+                return;
+            }
+        }
+    }
+    mg_close_connection(conn);
+}
+
+static void kislayphp_pool_clear(php_kislayphp_gateway_t *gateway) {
+    std::lock_guard<std::mutex> guard(gateway->upstream_lock);
+    for (auto &entry : gateway->upstreams) {
+        std::lock_guard<std::mutex> pool_guard(entry.second->lock);
+        for (const auto &idle : entry.second->idle) {
+            mg_close_connection(idle.conn);
+        }
+        entry.second->idle.clear();
+    }
+}
+
+static bool kislayphp_health_probe(php_kislayphp_gateway_t *gateway, kislayphp_upstream *upstream) {
+    char error_buf[256] = {0};
+    struct mg_connection *conn = mg_connect_client(upstream->host.c_str(), upstream->port, 0, error_buf, sizeof(error_buf));
+    if (conn == nullptr) {
+        return false;
+    }
+    mg_printf(conn,
+              "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: kislayphp-gateway-health\r\nConnection: close\r\n\r\n",
+              gateway->health_path.c_str(), upstream->host.c_str(), upstream->port);
+    bool ok = false;
+    if (mg_get_response(conn, error_buf, sizeof(error_buf), gateway->health_timeout_ms) >= 0) {
+        const struct mg_response_info *info = mg_get_response_info(conn);
+        int status = info != nullptr ? info->status_code : 0;
+        ok = gateway->health_statuses.empty()
+            ? status >= 200 && status < 300
+            : std::find(gateway->health_statuses.begin(), gateway->health_statuses.end(), status) != gateway->health_statuses.end();
+    }
+    mg_close_connection(conn);
+    return ok;
+}
+
+// Probes every known upstream once per interval. A target flips to
+// unhealthy after unhealthy_threshold failed probes in a row and back after
+// healthy_threshold successes. Upstreams are never freed while the gateway
+// lives, so the raw pointers stay valid without holding upstream_lock.
+static void kislayphp_health_loop(php_kislayphp_gateway_t *gateway) {
+    while (!gateway->health_stop.load(std::memory_order_acquire)) {
+        std::vector<kislayphp_upstream *> upstreams;
+        {
+            std::lock_guard<std::mutex> guard(gateway->upstream_lock);
+            for (auto &entry : gateway->upstreams) {
+                upstreams.push_back(entry.second.get());
+            }
+        }
+        for (kislayphp_upstream *upstream : upstreams) {
+            if (gateway->health_stop.load(std::memory_order_acquire)) {
+                return;
+            }
+            if (kislayphp_health_probe(gateway, upstream)) {
+                upstream->health_failures = 0;
+                if (++upstream->health_successes >= gateway->health_healthy_threshold) {
+                    upstream->healthy.store(true, std::memory_order_relaxed);
+                }
+            } else {
+                upstream->health_successes = 0;
+                if (++upstream->health_failures >= gateway->health_unhealthy_threshold) {
+                    upstream->healthy.store(false, std::memory_order_relaxed);
+                }
+            }
+        }
+        std::unique_lock<std::mutex> guard(gateway->health_lock);
+        gateway->health_cv.wait_for(guard, std::chrono::milliseconds(gateway->health_interval_ms), [gateway] {
+            return gateway->health_stop.load(std::memory_order_acquire);
+        });
+    }
+}
+
+static void kislayphp_health_start(php_kislayphp_gateway_t *gateway) {
+    if (gateway->health_path.empty() || gateway->health_thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(gateway->upstream_lock);
+        for (auto &entry : gateway->upstreams) {
+            entry.second->healthy.store(true, std::memory_order_relaxed);
+            entry.second->health_successes = 0;
+            entry.second->health_failures = 0;
+        }
+    }
+    gateway->health_stop.store(false, std::memory_order_release);
+    gateway->health_thread = std::thread(kislayphp_health_loop, gateway);
+}
+
+static void kislayphp_health_stop(php_kislayphp_gateway_t *gateway) {
+    if (!gateway->health_thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(gateway->health_lock);
+        gateway->health_stop.store(true, std::memory_order_release);
+    }
+    gateway->health_cv.notify_all();
+    gateway->health_thread.join();
+}
+
+// Waits for hedge attempts that lost their race but are still waiting on
+// an upstream, each bounded by its first-byte timeout, then joins the pool.
+static void kislayphp_hedge_drain(php_kislayphp_gateway_t *gateway) {
+    std::vector<std::thread> pool;
+    {
+        std::unique_lock<std::mutex> guard(gateway->hedge_lock);
+        gateway->hedge_cv.wait(guard, [gateway]() { return gateway->hedge_active == 0; });
+        gateway->hedge_stopping = true;
+        pool.swap(gateway->hedge_pool);
     }
+    gateway->hedge_work_cv.notify_all();
+    for (auto &thread : pool) {
+        thread.join();
+    }
+    std::lock_guard<std::mutex> guard(gateway->hedge_lock);
+    gateway->hedge_stopping = false;
+}
+
+static inline php_kislayphp_gateway_t *php_kislayphp_gateway_from_obj(zend_object *obj) {
+    return reinterpret_cast<php_kislayphp_gateway_t *>(
+        reinterpret_cast<char *>(obj) - XtOffsetOf(php_kislayphp_gateway_t, std));
+}
 
-    if (has_resolver) {
-        zval_ptr_dtor(&resolver);
+static zend_object *kislayphp_gateway_create_object(zend_class_entry *ce) {
+    php_kislayphp_gateway_t *obj = static_cast<php_kislayphp_gateway_t *>(
+        ecalloc(1, sizeof(php_kislayphp_gateway_t) + zend_object_properties_size(ce)));
+    zend_object_std_init(&obj->std, ce);
+    object_properties_init(&obj->std, ce);
+    new (&obj->route_table) kislayphp_snapshot<kislayphp_route_table>();
+    obj->route_table.publish(std::make_shared<kislayphp_route_table>());
+    new (&obj->registry) kislayphp_snapshot<kislayphp_registry>();
+    obj->registry.publish(std::make_shared<kislayphp_registry>());
+    new (&obj->lock) std::mutex();
+    obj->ctx = nullptr;
+    obj->running = false;
+    zend_long max_body = kislayphp_env_long("KISLAY_GATEWAY_MAX_BODY", 0);
+    if (max_body < 0) {
+        max_body = 0;
+    }
+    obj->max_body_bytes = static_cast<size_t>(max_body);
+    zend_long relay_buffer = kislayphp_env_long("KISLAY_GATEWAY_RELAY_BUFFER", 16384);
+    if (relay_buffer < 1024) {
+        relay_buffer = 1024;
+    }
+    obj->relay_buffer_bytes = static_cast<size_t>(relay_buffer);
+    zend_long threads = kislayphp_env_long("KISLAY_GATEWAY_THREADS", 1);
+    if (threads < 1) {
+        threads = 1;
+    }
+    obj->thread_count = static_cast<int>(threads);
+    ZVAL_UNDEF(&obj->resolver);
+    obj->has_resolver = false;
+    zend_long resolve_ttl = kislayphp_env_long("KISLAY_GATEWAY_RESOLVE_TTL_MS", 0);
+    if (resolve_ttl < 0) {
+        resolve_ttl = 0;
+    }
+    obj->resolve_ttl_ms = static_cast<int>(resolve_ttl);
+    zend_long resolve_stale = kislayphp_env_long("KISLAY_GATEWAY_RESOLVE_STALE_MS", 10000);
+    if (resolve_stale < 0) {
+        resolve_stale = 0;
+    }
+    obj->resolve_stale_ms = static_cast<int>(resolve_stale);
+    new (&obj->resolver_generation) std::atomic<uint64_t>(0);
+    new (&obj->resolve_hits) std::atomic<uint64_t>(0);
+    new (&obj->resolve_stale) std::atomic<uint64_t>(0);
+    new (&obj->resolver_calls) std::atomic<uint64_t>(0);
+    new (&obj->resolver_coalesced) std::atomic<uint64_t>(0);
+    new (&obj->executor_head) std::atomic<kislayphp_executor_node *>(nullptr);
+    new (&obj->executor_active) std::atomic<bool>(false);
+    new (&obj->executor_closed) std::atomic<bool>(false);
+    new (&obj->executor_backlog) std::atomic<size_t>(0);
+    new (&obj->executor_missed) std::atomic<bool>(false);
+    obj->executor_warned = false;
+    new (&obj->executor_lock) std::mutex();
+    new (&obj->executor_cv) std::condition_variable();
+    new (&obj->upstreams) std::unordered_map<std::string, std::unique_ptr<kislayphp_upstream>>();
+    new (&obj->upstream_lock) std::mutex();
+    new (&obj->pool_hits) std::atomic<uint64_t>(0);
+    new (&obj->pool_misses) std::atomic<uint64_t>(0);
+    zend_long pool_max_idle = kislayphp_env_long("KISLAY_GATEWAY_POOL_MAX_IDLE", 16);
+    if (pool_max_idle < 0) {
+        pool_max_idle = 0;
+    }
+    obj->pool_max_idle = static_cast<size_t>(pool_max_idle);
+    zend_long pool_lifetime = kislayphp_env_long("KISLAY_GATEWAY_POOL_MAX_LIFETIME_MS", 60000);
+    if (pool_lifetime < 1) {
+        pool_lifetime = 1;
+    }
+    obj->pool_max_lifetime_ms = static_cast<int>(pool_lifetime);
+    zend_long pool_idle_timeout = kislayphp_env_long("KISLAY_GATEWAY_POOL_IDLE_TIMEOUT_MS", 2000);
+    if (pool_idle_timeout < 1) {
+        pool_idle_timeout = 1;
+    }
+    obj->pool_idle_timeout_ms = static_cast<int>(pool_idle_timeout);
+    zend_long ewma_decay = kislayphp_env_long("KISLAY_GATEWAY_EWMA_DECAY_MS", 10000);
+    if (ewma_decay < 1) {
+        ewma_decay = 1;
+    }
+    obj->ewma_decay_ms = static_cast<int>(ewma_decay);
+    zend_long first_byte_timeout = kislayphp_env_long("KISLAY_GATEWAY_FIRST_BYTE_TIMEOUT_MS", 10000);
+    if (first_byte_timeout < 1) {
+        first_byte_timeout = 1;
+    }
+    obj->first_byte_timeout_ms = static_cast<int>(first_byte_timeout);
+    zend_long total_timeout = kislayphp_env_long("KISLAY_GATEWAY_TIMEOUT_MS", 0);
+    if (total_timeout < 0) {
+        total_timeout = 0;
+    }
+    obj->total_timeout_ms = static_cast<int>(total_timeout);
+    zend_long retries = kislayphp_env_long("KISLAY_GATEWAY_RETRIES", 1);
+    obj->retries = static_cast<int>(std::min<zend_long>(std::max<zend_long>(retries, 0), KISLAYPHP_MAX_RETRIES));
+    zend_long retry_budget = kislayphp_env_long("KISLAY_GATEWAY_RETRY_BUDGET_PERCENT", 10);
+    obj->retry_budget_percent = static_cast<int>(std::min<zend_long>(std::max<zend_long>(retry_budget, 0), 100));
+    zend_long retry_min = kislayphp_env_long("KISLAY_GATEWAY_RETRY_MIN_PER_SEC", 10);
+    obj->retry_min_per_sec = static_cast<int>(std::min<zend_long>(std::max<zend_long>(retry_min, 0), KISLAYPHP_RETRY_TOKEN_CAP));
+    new (&obj->retry_tokens) std::atomic<int64_t>(static_cast<int64_t>(obj->retry_min_per_sec) * 1000);
+    new (&obj->retry_refilled) std::atomic<int64_t>(kislayphp_now_ns());
+    new (&obj->retries_done) std::atomic<uint64_t>(0);
+    new (&obj->retries_denied) std::atomic<uint64_t>(0);
+    new (&obj->hedges) std::atomic<uint64_t>(0);
+    new (&obj->hedge_wins) std::atomic<uint64_t>(0);
+    zend_long hedge_threads = kislayphp_env_long("KISLAY_GATEWAY_HEDGE_THREADS", 32);
+    obj->hedge_threads_max = static_cast<size_t>(std::max<zend_long>(hedge_threads, 1));
+    obj->hedge_active = 0;
+    obj->hedge_stopping = false;
+    new (&obj->hedge_pool) std::vector<std::thread>();
+    new (&obj->hedge_queue) std::deque<std::pair<std::shared_ptr<kislayphp_hedge_race>, size_t>>();
+    new (&obj->hedge_lock) std::mutex();
+    new (&obj->hedge_cv) std::condition_variable();
+    new (&obj->hedge_work_cv) std::condition_variable();
+    zend_long limit_max = kislayphp_env_long("KISLAY_GATEWAY_CONCURRENCY_LIMIT_MAX", 0);
+    obj->limit_max = static_cast<int>(std::min<zend_long>(std::max<zend_long>(limit_max, 0), INT_MAX));
+    obj->limit_min = 1;
+    zend_long limit_initial = kislayphp_env_long("KISLAY_GATEWAY_CONCURRENCY_LIMIT_INITIAL", 20);
+    obj->limit_initial = static_cast<int>(std::min<zend_long>(std::max<zend_long>(limit_initial, 1), std::max(obj->limit_max, 1)));
+    zend_long limit_queue = kislayphp_env_long("KISLAY_GATEWAY_CONCURRENCY_QUEUE_MS", 50);
+    obj->limit_queue_ms = static_cast<int>(std::min<zend_long>(std::max<zend_long>(limit_queue, 0), INT_MAX));
+    obj->limit_tolerance = 2.0;
+    obj->limit_backoff = 0.9;
+    new (&obj->limit_shed) std::atomic<uint64_t>(0);
+    new (&obj->cache) std::shared_ptr<kislayphp_response_cache>(
+        kislayphp_cache_create(static_cast<size_t>(std::max<zend_long>(kislayphp_env_long("KISLAY_GATEWAY_CACHE_BYTES", 64 << 20), 0)),
+                               static_cast<size_t>(std::max<zend_long>(kislayphp_env_long("KISLAY_GATEWAY_CACHE_SHARDS", 16), 1))));
+    const char *cache_file = std::getenv("KISLAY_GATEWAY_CACHE_FILE");
+    if (obj->cache && cache_file != nullptr && *cache_file != '\0') {
+        std::string error;
+        obj->cache->disk = kislayphp_disk_open(cache_file,
+            static_cast<size_t>(std::max<zend_long>(kislayphp_env_long("KISLAY_GATEWAY_CACHE_FILE_BYTES", 256 << 20), 0)), error);
+        if (!obj->cache->disk) {
+            php_error_docref(nullptr, E_WARNING, "KISLAY_GATEWAY_CACHE_FILE ignored: %s", error.c_str());
+        }
+    }
+    zend_long outlier_errors = kislayphp_env_long("KISLAY_GATEWAY_OUTLIER_ERRORS", 0);
+    if (outlier_errors < 0) {
+        outlier_errors = 0;
+    }
+    obj->outlier_errors = static_cast<uint32_t>(outlier_errors);
+    zend_long outlier_base = kislayphp_env_long("KISLAY_GATEWAY_OUTLIER_EJECT_MS", 30000);
+    if (outlier_base < 1) {
+        outlier_base = 1;
+    }
+    obj->outlier_base_ms = static_cast<int>(outlier_base);
+    zend_long outlier_max = kislayphp_env_long("KISLAY_GATEWAY_OUTLIER_MAX_EJECT_MS", 300000);
+    if (outlier_max < outlier_base) {
+        outlier_max = outlier_base;
+    }
+    obj->outlier_max_ms = static_cast<int>(outlier_max);
+    new (&obj->health_path) std::string();
+    obj->health_interval_ms = 5000;
+    obj->health_timeout_ms = 2000;
+    obj->health_healthy_threshold = 2;
+    obj->health_unhealthy_threshold = 3;
+    new (&obj->health_statuses) std::vector<int>();
+    new (&obj->health_thread) std::thread();
+    new (&obj->health_lock) std::mutex();
+    new (&obj->health_cv) std::condition_variable();
+    new (&obj->health_stop) std::atomic<bool>(false);
+    obj->keep_alive = kislayphp_env_long("KISLAY_GATEWAY_KEEP_ALIVE", 1) != 0;
+    zend_long keep_alive_timeout = kislayphp_env_long("KISLAY_GATEWAY_KEEP_ALIVE_TIMEOUT_MS", 5000);
+    if (keep_alive_timeout < 1) {
+        keep_alive_timeout = 1;
+    }
+    obj->keep_alive_timeout_ms = static_cast<int>(keep_alive_timeout);
+    zend_long keep_alive_max = kislayphp_env_long("KISLAY_GATEWAY_KEEP_ALIVE_MAX_REQUESTS", 100);
+    if (keep_alive_max < 0) {
+        keep_alive_max = 0;
+    }
+    obj->keep_alive_max_requests = static_cast<size_t>(keep_alive_max);
+    obj->std.handlers = &kislayphp_gateway_handlers;
+    return &obj->std;
+}
+
+static void kislayphp_gateway_free_obj(zend_object *object) {
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(object);
+    obj->executor_closed.store(true, std::memory_order_release);
+    if (obj->ctx != nullptr) {
+        mg_stop(obj->ctx);
+        obj->ctx = nullptr;
+    }
+    kislayphp_health_stop(obj);
+    kislayphp_hedge_drain(obj);
+    if (obj->has_resolver) {
+        zval_ptr_dtor(&obj->resolver);
+    }
+    kislayphp_pool_clear(obj);
+    obj->cache.~shared_ptr();
+    obj->limit_shed.~atomic();
+    obj->hedge_work_cv.~condition_variable();
+    obj->hedge_cv.~condition_variable();
+    obj->hedge_lock.~mutex();
+    obj->hedge_queue.~deque();
+    obj->hedge_pool.~vector();
+    obj->hedge_wins.~atomic();
+    obj->hedges.~atomic();
+    obj->retries_denied.~atomic();
+    obj->retries_done.~atomic();
+    obj->retry_refilled.~atomic();
+    obj->retry_tokens.~atomic();
+    obj->health_stop.~atomic();
+    obj->health_cv.~condition_variable();
+    obj->health_lock.~mutex();
+    obj->health_thread.~thread();
+    obj->health_statuses.~vector();
+    obj->health_path.~basic_string();
+    obj->pool_misses.~atomic();
+    obj->pool_hits.~atomic();
+    obj->upstream_lock.~mutex();
+    obj->upstreams.~unordered_map();
+    kislayphp_executor_node *node = obj->executor_head.exchange(nullptr);
+    while (node != nullptr) {
+        kislayphp_executor_node *next = node->next;
+        if (node->job->refresh && node->job->slot) {
+            node->job->slot->refreshing.store(false, std::memory_order_release);
+        }
+        delete node;
+        node = next;
+    }
+    obj->executor_cv.~condition_variable();
+    obj->executor_lock.~mutex();
+    obj->executor_missed.~atomic();
+    obj->executor_backlog.~atomic();
+    obj->executor_closed.~atomic();
+    obj->executor_active.~atomic();
+    obj->executor_head.~atomic();
+    obj->resolver_coalesced.~atomic();
+    obj->resolver_calls.~atomic();
+    obj->resolve_stale.~atomic();
+    obj->resolve_hits.~atomic();
+    obj->resolver_generation.~atomic();
+    obj->registry.~kislayphp_snapshot();
+    obj->route_table.~kislayphp_snapshot();
+    obj->lock.~mutex();
+    zend_object_std_dtor(&obj->std);
+}
+
+static std::string kislayphp_to_upper(const std::string &value) {
+    std::string out = value;
+    std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) {
+        return static_cast<char>(std::toupper(c));
+    });
+    return out;
+}
+
+static std::string kislayphp_join_paths(const std::string &base, const std::string &path) {
+    if (base.empty()) {
+        return path.empty() ? std::string("/") : path;
+    }
+    if (path.empty()) {
+        return base;
+    }
+    if (base.back() == '/' && path.front() == '/') {
+        return base + path.substr(1);
+    }
+    if (base.back() != '/' && path.front() != '/') {
+        return base + "/" + path;
+    }
+    return base + path;
+}
+
+static kislayphp_method kislayphp_method_from(const char *name) {
+    static const char *const names[KISLAYPHP_METHOD_KNOWN] = {
+        "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT", "TRACE",
+    };
+    if (name == nullptr) {
+        return KISLAYPHP_METHOD_OTHER;
+    }
+    for (size_t i = 0; i < KISLAYPHP_METHOD_KNOWN; ++i) {
+        if (::strcasecmp(name, names[i]) == 0) {
+            return static_cast<kislayphp_method>(i);
+        }
+    }
+    return KISLAYPHP_METHOD_OTHER;
+}
+
+static std::vector<std::unique_ptr<kislayphp_route_node>>::const_iterator
+kislayphp_router_slot(const kislayphp_route_node *node, unsigned char first) {
+    return std::lower_bound(node->children.begin(), node->children.end(), first,
+                            [](const std::unique_ptr<kislayphp_route_node> &child, unsigned char c) {
+                                return static_cast<unsigned char>(child->label[0]) < c;
+                            });
+}
+
+static kislayphp_route_node *kislayphp_router_child(const kislayphp_route_node *node, unsigned char first) {
+    auto it = kislayphp_router_slot(node, first);
+    if (it == node->children.end() || static_cast<unsigned char>((*it)->label[0]) != first) {
+        return nullptr;
+    }
+    return it->get();
+}
+
+static kislayphp_route_node *kislayphp_router_root(kislayphp_router &router, const kislayphp_gateway_route &route) {
+    if (route.method_id != KISLAYPHP_METHOD_OTHER) {
+        return &router.methods[route.method_id];
+    }
+    for (auto &entry : router.other_methods) {
+        if (entry.first == route.method) {
+            return entry.second.get();
+        }
+    }
+    router.other_methods.emplace_back(route.method, std::unique_ptr<kislayphp_route_node>(new kislayphp_route_node()));
+    return router.other_methods.back().second.get();
+}
+
+static kislayphp_route_node *kislayphp_router_insert_literal(kislayphp_route_node *node, const char *key, size_t len) {
+    while (len > 0) {
+        unsigned char first = static_cast<unsigned char>(key[0]);
+        kislayphp_route_node *child = kislayphp_router_child(node, first);
+        if (child == nullptr) {
+            std::unique_ptr<kislayphp_route_node> leaf(new kislayphp_route_node());
+            leaf->label.assign(key, len);
+            child = leaf.get();
+            node->children.insert(kislayphp_router_slot(node, first), std::move(leaf));
+            return child;
+        }
+        size_t common = 0;
+        while (common < len && common < child->label.size() && child->label[common] == key[common]) {
+            ++common;
+        }
+        if (common < child->label.size()) {
+            auto it = node->children.begin() + (kislayphp_router_slot(node, first) - node->children.begin());
+            std::unique_ptr<kislayphp_route_node> split(new kislayphp_route_node());
+            split->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            split->children.push_back(std::move(*it));
+            *it = std::move(split);
+            child = it->get();
+        }
+        node = child;
+        key += common;
+        len -= common;
+    }
+    return node;
+}
+
+// Validates a route pattern and collects its "{name}" parameters. A
+// parameter must span a whole segment; only a trailing '*' is a wildcard.
+static bool kislayphp_compile_pattern(kislayphp_gateway_route &route, std::string &error) {
+    route.param_names.clear();
+    const std::string &path = route.path;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        if (path[pos] == '}') {
+            error = "Unbalanced '}' in route pattern";
+            return false;
+        }
+        if (path[pos] != '{') {
+            ++pos;
+            continue;
+        }
+        size_t close = path.find('}', pos);
+        if (close == std::string::npos) {
+            error = "Unterminated '{' in route pattern";
+            return false;
+        }
+        std::string name = path.substr(pos + 1, close - pos - 1);
+        if (name.empty() || name.find_first_of("{/*") != std::string::npos) {
+            error = "Invalid parameter name in route pattern";
+            return false;
+        }
+        if (pos == 0 || path[pos - 1] != '/') {
+            error = "Route parameters must start a path segment";
+            return false;
+        }
+        if (close + 1 < path.size() && path[close + 1] != '/' &&
+            !(path[close + 1] == '*' && close + 2 == path.size())) {
+            error = "Route parameters must end a path segment";
+            return false;
+        }
+        if (std::find(route.param_names.begin(), route.param_names.end(), name) != route.param_names.end()) {
+            error = "Duplicate parameter name in route pattern";
+            return false;
+        }
+        route.param_names.push_back(name);
+        if (route.param_names.size() > KISLAYPHP_MAX_ROUTE_PARAMS) {
+            error = "Too many parameters in route pattern";
+            return false;
+        }
+        pos = close + 1;
+    }
+    return true;
+}
+
+// Inserts routes[index]. An earlier route with the same method and pattern
+// keeps precedence, as it did with the linear scan.
+static void kislayphp_router_insert(kislayphp_router &router, const std::vector<kislayphp_gateway_route> &routes, size_t index) {
+    const kislayphp_gateway_route &route = routes[index];
+    kislayphp_route_node *node = kislayphp_router_root(router, route);
+    bool wildcard = !route.path.empty() && route.path.back() == '*';
+    const char *key = route.path.data();
+    const char *end = key + route.path.size() - (wildcard ? 1 : 0);
+
+    while (key < end) {
+        const char *brace = static_cast<const char *>(std::memchr(key, '{', static_cast<size_t>(end - key)));
+        if (brace == nullptr) {
+            node = kislayphp_router_insert_literal(node, key, static_cast<size_t>(end - key));
+            break;
+        }
+        node = kislayphp_router_insert_literal(node, key, static_cast<size_t>(brace - key));
+        if (!node->param) {
+            node->param.reset(new kislayphp_route_node());
+        }
+        node = node->param.get();
+        key = static_cast<const char *>(std::memchr(brace, '}', static_cast<size_t>(end - brace))) + 1;
+    }
+
+    int &slot = wildcard ? node->wildcard : node->exact;
+    if (slot < 0) {
+        slot = static_cast<int>(index);
+    }
+}
+
+static void kislayphp_router_build(kislayphp_route_table &table) {
+    for (size_t i = 0; i < table.routes.size(); ++i) {
+        kislayphp_router_insert(table.router, table.routes, i);
+    }
+}
+
+struct kislayphp_router_search {
+    const char *path;
+    size_t len;
+    size_t depth;
+    size_t offset[KISLAYPHP_MAX_ROUTE_PARAMS];
+    size_t length[KISLAYPHP_MAX_ROUTE_PARAMS];
+    int wildcard;
+    size_t wildcard_pos;
+    size_t wildcard_depth;
+    size_t wildcard_offset[KISLAYPHP_MAX_ROUTE_PARAMS];
+    size_t wildcard_length[KISLAYPHP_MAX_ROUTE_PARAMS];
+};
+
+// Depth-first walk trying literal edges before parameters. Returns the exact
+// route index as soon as one is found; wildcard candidates are remembered in
+// the search state, longest consumed prefix first.
+static int kislayphp_router_walk(const kislayphp_route_node *node, size_t pos, kislayphp_router_search &search) {
+    if (node->wildcard >= 0 && (search.wildcard < 0 || pos > search.wildcard_pos)) {
+        search.wildcard = node->wildcard;
+        search.wildcard_pos = pos;
+        search.wildcard_depth = search.depth;
+        std::memcpy(search.wildcard_offset, search.offset, search.depth * sizeof(size_t));
+        std::memcpy(search.wildcard_length, search.length, search.depth * sizeof(size_t));
+    }
+    if (pos == search.len) {
+        return node->exact;
+    }
+
+    const kislayphp_route_node *child = kislayphp_router_child(node, static_cast<unsigned char>(search.path[pos]));
+    if (child != nullptr && search.len - pos >= child->label.size() &&
+        std::memcmp(search.path + pos, child->label.data(), child->label.size()) == 0) {
+        int found = kislayphp_router_walk(child, pos + child->label.size(), search);
+        if (found >= 0) {
+            return found;
+        }
+    }
+
+    if (node->param && search.path[pos] != '/' && search.depth < KISLAYPHP_MAX_ROUTE_PARAMS) {
+        size_t end = pos;
+        while (end < search.len && search.path[end] != '/') {
+            ++end;
+        }
+        search.offset[search.depth] = pos;
+        search.length[search.depth] = end - pos;
+        ++search.depth;
+        int found = kislayphp_router_walk(node->param.get(), end, search);
+        --search.depth;
+        if (found >= 0) {
+            return found;
+        }
+    }
+    return -1;
+}
+
+// Allocation-free lookup. An exact pattern wins over wildcards, literal
+// segments win over parameters, and the longest matching "<prefix>*" wins
+// among wildcards.
+static bool kislayphp_router_match(const kislayphp_route_table &table,
+                                   const char *method,
+                                   const char *path,
+                                   kislayphp_route_match &match) {
+    kislayphp_method method_id = kislayphp_method_from(method);
+    const kislayphp_route_node *node = nullptr;
+    if (method_id != KISLAYPHP_METHOD_OTHER) {
+        node = &table.router.methods[method_id];
+    } else if (method != nullptr) {
+        for (const auto &entry : table.router.other_methods) {
+            if (::strcasecmp(entry.first.c_str(), method) == 0) {
+                node = entry.second.get();
+                break;
+            }
+        }
+    }
+    if (node == nullptr) {
+        return false;
+    }
+
+    kislayphp_router_search search;
+    search.path = path;
+    search.len = std::strlen(path);
+    search.depth = 0;
+    search.wildcard = -1;
+    search.wildcard_pos = 0;
+    search.wildcard_depth = 0;
+    int found = kislayphp_router_walk(node, 0, search);
+    const size_t *offsets = search.offset;
+    const size_t *lengths = search.length;
+    size_t depth = 0;
+    if (found >= 0) {
+        depth = table.routes[static_cast<size_t>(found)].param_names.size();
+    } else if (search.wildcard >= 0) {
+        found = search.wildcard;
+        offsets = search.wildcard_offset;
+        lengths = search.wildcard_length;
+        depth = search.wildcard_depth;
+    } else {
+        return false;
+    }
+
+    match.route = &table.routes[static_cast<size_t>(found)];
+    match.path = path;
+    match.param_count = depth;
+    std::memcpy(match.param_offset, offsets, depth * sizeof(size_t));
+    std::memcpy(match.param_length, lengths, depth * sizeof(size_t));
+    return true;
+}
+
+static bool kislayphp_is_header_token(const std::string &name) {
+    if (name.empty()) {
+        return false;
+    }
+    for (unsigned char c : name) {
+        if (!std::isalnum(c) && std::strchr("!#$%&'*+-.^_`|~", c) == nullptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses the "circuit_breaker" route option: ['failures' => n, 'open_ms' =>
+// ms, 'half_open_requests' => n]. failures is required.
+static bool kislayphp_parse_breaker(zval *value, kislayphp_breaker_config &config, std::string &error) {
+    if (Z_TYPE_P(value) != IS_ARRAY) {
+        error = "circuit_breaker must be an array";
+        return false;
+    }
+    zend_long failures = 0;
+    zend_long open_ms = 10000;
+    zend_long half_open_requests = 1;
+    zend_string *key = nullptr;
+    zval *setting = nullptr;
+    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(value), key, setting) {
+        std::string name = key != nullptr ? std::string(ZSTR_VAL(key), ZSTR_LEN(key)) : std::string();
+        if (name == "failures") {
+            failures = zval_get_long(setting);
+        } else if (name == "open_ms") {
+            open_ms = zval_get_long(setting);
+        } else if (name == "half_open_requests") {
+            half_open_requests = zval_get_long(setting);
+        } else {
+            error = "Unknown circuit_breaker option: " + name;
+            return false;
+        }
+    } ZEND_HASH_FOREACH_END();
+    if (failures < 1 || open_ms < 1 || half_open_requests < 1) {
+        error = "circuit_breaker failures, open_ms and half_open_requests must be >= 1";
+        return false;
+    }
+    config.failures = static_cast<uint32_t>(failures);
+    config.open_ms = static_cast<int>(open_ms);
+    config.half_open_requests = static_cast<uint32_t>(half_open_requests);
+    return true;
+}
+
+// Parses the "hedge" route option: true (hedge at the p95 latency), false,
+// or ['percentile' => p, 'delay_ms' => ms], where delay_ms is used until the
+// route has seen enough responses to know its percentile.
+static bool kislayphp_parse_hedge(zval *value, kislayphp_gateway_route &route, std::string &error) {
+    double percentile = 95.0;
+    zend_long delay_ms = 50;
+    if (Z_TYPE_P(value) == IS_FALSE) {
+        route.hedge_percentile = 0;
+        route.latency.reset();
+        return true;
+    }
+    if (Z_TYPE_P(value) == IS_ARRAY) {
+        zend_string *key = nullptr;
+        zval *setting = nullptr;
+        ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(value), key, setting) {
+            std::string name = key != nullptr ? std::string(ZSTR_VAL(key), ZSTR_LEN(key)) : std::string();
+            if (name == "percentile") {
+                percentile = zval_get_double(setting);
+            } else if (name == "delay_ms") {
+                delay_ms = zval_get_long(setting);
+            } else {
+                error = "Unknown hedge option: " + name;
+                return false;
+            }
+        } ZEND_HASH_FOREACH_END();
+    } else if (Z_TYPE_P(value) != IS_TRUE) {
+        error = "hedge must be a bool or an array";
+        return false;
+    }
+    if (!(percentile >= 50.0 && percentile < 100.0)) {
+        error = "hedge percentile must be >= 50 and < 100";
+        return false;
+    }
+    if (delay_ms < 1 || delay_ms > INT_MAX) {
+        error = "hedge delay_ms must be >= 1";
+        return false;
+    }
+    route.hedge_percentile = percentile;
+    route.hedge_delay_ms = static_cast<int>(delay_ms);
+    route.latency = std::make_shared<kislayphp_latency_histogram>();
+    return true;
+}
+
+// Parses the "cache" route option: true, false, or ['ttl' => s,
+// 'max_entry_bytes' => n]. ttl is the freshness given to 200 responses that
+// carry no Cache-Control or Expires of their own.
+static bool kislayphp_parse_cache(zval *value, kislayphp_gateway_route &route, std::string &error) {
+    zend_long ttl = 0;
+    zend_long max_entry_bytes = 1 << 20;
+    if (Z_TYPE_P(value) == IS_FALSE) {
+        route.cache = false;
+        return true;
+    }
+    if (Z_TYPE_P(value) == IS_ARRAY) {
+        zend_string *key = nullptr;
+        zval *setting = nullptr;
+        ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(value), key, setting) {
+            std::string name = key != nullptr ? std::string(ZSTR_VAL(key), ZSTR_LEN(key)) : std::string();
+            if (name == "ttl") {
+                ttl = zval_get_long(setting);
+            } else if (name == "max_entry_bytes") {
+                max_entry_bytes = zval_get_long(setting);
+            } else {
+                error = "Unknown cache option: " + name;
+                return false;
+            }
+        } ZEND_HASH_FOREACH_END();
+    } else if (Z_TYPE_P(value) != IS_TRUE) {
+        error = "cache must be a bool or an array";
+        return false;
+    }
+    if (ttl < 0 || ttl > INT_MAX) {
+        error = "cache ttl must be >= 0";
+        return false;
+    }
+    if (max_entry_bytes < 1) {
+        error = "cache max_entry_bytes must be >= 1";
+        return false;
+    }
+    route.cache = true;
+    route.cache_ttl = static_cast<int>(ttl);
+    route.cache_max_entry_bytes = static_cast<size_t>(max_entry_bytes);
+    return true;
+}
+
+// Applies the optional per-route settings array accepted by addRoute() and
+// addServiceRoute(). Must run after kislayphp_compile_pattern().
+static bool kislayphp_apply_route_options(kislayphp_gateway_route &route, HashTable *options, std::string &error) {
+    route.param_headers.clear();
+    for (const auto &name : route.param_names) {
+        route.param_headers.push_back("X-Route-Param-" + name);
+    }
+    if (options == nullptr) {
+        return true;
+    }
+
+    zend_string *key = nullptr;
+    zval *value = nullptr;
+    ZEND_HASH_FOREACH_STR_KEY_VAL(options, key, value) {
+        if (key == nullptr) {
+            error = "Route options must be keyed by name";
+            return false;
+        }
+        std::string option(ZSTR_VAL(key), ZSTR_LEN(key));
+        if (option == "param_headers") {
+            if (Z_TYPE_P(value) != IS_ARRAY) {
+                error = "param_headers must be an array of parameter => header name";
+                return false;
+            }
+            zend_string *param = nullptr;
+            zval *header = nullptr;
+            ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(value), param, header) {
+                if (param == nullptr || Z_TYPE_P(header) != IS_STRING) {
+                    error = "param_headers must be an array of parameter => header name";
+                    return false;
+                }
+                auto it = std::find(route.param_names.begin(), route.param_names.end(),
+                                    std::string(ZSTR_VAL(param), ZSTR_LEN(param)));
+                if (it == route.param_names.end()) {
+                    error = "param_headers names a parameter the pattern does not declare";
+                    return false;
+                }
+                std::string name(Z_STRVAL_P(header), Z_STRLEN_P(header));
+                if (!name.empty() && !kislayphp_is_header_token(name)) {
+                    error = "Invalid header name in param_headers";
+                    return false;
+                }
+                route.param_headers[static_cast<size_t>(it - route.param_names.begin())] = name;
+            } ZEND_HASH_FOREACH_END();
+        } else if (option == "retries") {
+            if (Z_TYPE_P(value) != IS_LONG || Z_LVAL_P(value) < 0 || Z_LVAL_P(value) > KISLAYPHP_MAX_RETRIES) {
+                error = "retries must be an int between 0 and " + std::to_string(KISLAYPHP_MAX_RETRIES);
+                return false;
+            }
+            route.retries = static_cast<int>(Z_LVAL_P(value));
+        } else if (option == "timeout_ms") {
+            if (Z_TYPE_P(value) != IS_LONG || Z_LVAL_P(value) < 0 || Z_LVAL_P(value) > INT_MAX) {
+                error = "timeout_ms must be an int >= 0";
+                return false;
+            }
+            route.timeout_ms = static_cast<int>(Z_LVAL_P(value));
+        } else if (option == "first_byte_timeout_ms") {
+            if (Z_TYPE_P(value) != IS_LONG || Z_LVAL_P(value) < 1 || Z_LVAL_P(value) > INT_MAX) {
+                error = "first_byte_timeout_ms must be an int >= 1";
+                return false;
+            }
+            route.first_byte_timeout_ms = static_cast<int>(Z_LVAL_P(value));
+        } else if (option == "circuit_breaker") {
+            if (!kislayphp_parse_breaker(value, route.breaker_config, error)) {
+                return false;
+            }
+            route.breaker = std::make_shared<kislayphp_breaker>();
+        } else if (option == "hedge") {
+            if (!kislayphp_parse_hedge(value, route, error)) {
+                return false;
+            }
+        } else if (option == "cache") {
+            if (!kislayphp_parse_cache(value, route, error)) {
+                return false;
+            }
+        } else if (option == "balancer" || option == "hash_key") {
+            if (route.use_service) {
+                error = "Service routes take their balancer from registerService()";
+                return false;
+            }
+            if (!kislayphp_apply_balancing_option(option, value, route.targets->balancing, error)) {
+                return false;
+            }
+            const kislayphp_hash_key &hash_key = route.targets->balancing.hash_key;
+            if (hash_key.source == KISLAYPHP_HASH_PARAM &&
+                std::find(route.param_names.begin(), route.param_names.end(), hash_key.name) == route.param_names.end()) {
+                error = "hash_key names a parameter the pattern does not declare";
+                return false;
+            }
+        } else {
+            error = "Unknown route option: " + option;
+            return false;
+        }
+    } ZEND_HASH_FOREACH_END();
+    return true;
+}
+
+// Captures come from the decoded path, so a value carrying control bytes
+// (e.g. %0D%0A) must never reach an upstream header line.
+static bool kislayphp_params_are_safe(const kislayphp_route_match &params) {
+    for (size_t i = 0; i < params.param_count; ++i) {
+        const char *value = params.path + params.param_offset[i];
+        for (size_t j = 0; j < params.param_length[i]; ++j) {
+            unsigned char c = static_cast<unsigned char>(value[j]);
+            if (c < 0x20 || c == 0x7f) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool kislayphp_parse_target(const std::string &target, kislayphp_endpoint &endpoint) {
+    std::string value = target;
+    const std::string prefix = "http://";
+    if (value.rfind(prefix, 0) == 0) {
+        value = value.substr(prefix.size());
+    }
+
+    std::string hostport;
+    std::string base_path = "/";
+    size_t slash = value.find('/');
+    if (slash == std::string::npos) {
+        hostport = value;
+    } else {
+        hostport = value.substr(0, slash);
+        base_path = value.substr(slash);
+    }
+
+    if (hostport.empty()) {
+        return false;
+    }
+
+    std::string host = hostport;
+    int port = 80;
+    size_t colon = hostport.find(':');
+    if (colon != std::string::npos) {
+        host = hostport.substr(0, colon);
+        std::string port_str = hostport.substr(colon + 1);
+        if (port_str.empty()) {
+            return false;
+        }
+        port = std::atoi(port_str.c_str());
+        if (port <= 0) {
+            return false;
+        }
+    }
+
+    endpoint.target = target;
+    endpoint.host = host;
+    endpoint.port = port;
+    endpoint.base_path = base_path;
+    return true;
+}
+
+// A callback that throws is reported as a warning and counts as failed, so
+// the executor can go on with the next job. Only exit() stays pending.
+static bool kislayphp_call_php(zval *callable, uint32_t argc, zval *argv, zval *retval) {
+    ZVAL_UNDEF(retval);
+    if (call_user_function(EG(function_table), nullptr, callable, retval, argc, argv) == FAILURE) {
+        return false;
+    }
+    if (EG(exception) != nullptr) {
+        if (!zend_is_unwind_exit(EG(exception))) {
+            zend_exception_error(EG(exception), E_WARNING);
+        }
+        zval_ptr_dtor(retval);
+        ZVAL_UNDEF(retval);
+        return false;
+    }
+    return true;
+}
+
+static int kislayphp_resolution_ms(zval *value, int fallback) {
+    if (value == nullptr) {
+        return fallback;
+    }
+    zend_long ms = zval_get_long(value);
+    return ms < 0 ? 0 : static_cast<int>(ms);
+}
+
+static std::shared_ptr<kislayphp_resolve_job> kislayphp_make_resolve_job(const struct mg_request_info *info,
+                                                                        const kislayphp_gateway_route &route,
+                                                                        const kislayphp_route_match &params,
+                                                                        bool refresh) {
+    auto job = std::make_shared<kislayphp_resolve_job>();
+    job->slot = route.resolution;
+    job->service = route.service;
+    job->method = kislayphp_to_upper(info->request_method ? info->request_method : "");
+    job->path = params.path;
+    for (size_t i = 0; i < params.param_count; ++i) {
+        job->params.emplace_back(route.param_names[i],
+                                 std::string(params.path + params.param_offset[i], params.param_length[i]));
+    }
+    job->refresh = refresh;
+    return job;
+}
+
+// Caches a resolved endpoint in a route's slot when it came with a TTL.
+static void kislayphp_resolution_store(kislayphp_resolution_slot *slot, const kislayphp_resolve_job &resolved) {
+    if (resolved.ttl_ms <= 0 || slot == nullptr) {
+        return;
+    }
+    auto entry = std::make_shared<kislayphp_resolution>();
+    entry->endpoint = resolved.endpoint;
+    entry->generation = resolved.generation;
+    entry->fresh_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(resolved.ttl_ms);
+    entry->stale_until = entry->fresh_until + std::chrono::milliseconds(resolved.stale_ms);
+    std::lock_guard<std::mutex> guard(slot->lock);
+    slot->current = std::move(entry);
+}
+
+// Calls the PHP resolver for a service route. The callable returns either a
+// target string, cached for the gateway's default TTL, or an array
+// ['target' => ..., 'ttl' => ms, 'stale' => ms]. A positive TTL stores the
+// parsed endpoint in the route's resolution slot and is kept in job.ttl_ms.
+// On failure job.error holds the 502 message to send. Must only run on the
+// PHP thread.
+static void kislayphp_run_resolve_job(php_kislayphp_gateway_t *gateway, kislayphp_resolve_job &job) {
+    zval resolver;
+    ZVAL_UNDEF(&resolver);
+    bool has_resolver = false;
+    uint64_t generation = 0;
+    {
+        std::lock_guard<std::mutex> guard(gateway->lock);
+        if (gateway->has_resolver) {
+            ZVAL_COPY(&resolver, &gateway->resolver);
+            has_resolver = true;
+        }
+        generation = gateway->resolver_generation.load(std::memory_order_relaxed);
+    }
+    if (!has_resolver) {
+        job.error = "Service resolver not configured";
+        return;
+    }
+
+    zval args[4];
+    ZVAL_STRING(&args[0], job.service.c_str());
+    ZVAL_STRING(&args[1], job.method.c_str());
+    ZVAL_STRINGL(&args[2], job.path.data(), job.path.size());
+    array_init(&args[3]);
+    for (const auto &param : job.params) {
+        add_assoc_stringl(&args[3], param.first.c_str(), param.second.data(), param.second.size());
+    }
+    zval retval;
+    bool ok = kislayphp_call_php(&resolver, 4, args, &retval);
+    for (zval &arg : args) {
+        zval_ptr_dtor(&arg);
+    }
+    zval_ptr_dtor(&resolver);
+    gateway->resolver_calls.fetch_add(1, std::memory_order_relaxed);
+    if (!ok) {
+        job.error = "Service resolver failed";
+        return;
+    }
+
+    std::string target;
+    int ttl_ms = gateway->resolve_ttl_ms;
+    int stale_ms = gateway->resolve_stale_ms;
+    bool valid = true;
+    if (Z_TYPE(retval) == IS_STRING) {
+        target.assign(Z_STRVAL(retval), Z_STRLEN(retval));
+    } else if (Z_TYPE(retval) == IS_ARRAY) {
+        zval *value = zend_hash_str_find(Z_ARRVAL(retval), "target", sizeof("target") - 1);
+        if (value != nullptr && Z_TYPE_P(value) == IS_STRING) {
+            target.assign(Z_STRVAL_P(value), Z_STRLEN_P(value));
+        } else {
+            valid = false;
+        }
+        ttl_ms = kislayphp_resolution_ms(zend_hash_str_find(Z_ARRVAL(retval), "ttl", sizeof("ttl") - 1), ttl_ms);
+        stale_ms = kislayphp_resolution_ms(zend_hash_str_find(Z_ARRVAL(retval), "stale", sizeof("stale") - 1), stale_ms);
+    } else {
+        valid = false;
+    }
+    zval_ptr_dtor(&retval);
+    if (!valid) {
+        job.error = "Service resolver failed";
+        return;
+    }
+    if (!kislayphp_parse_target(target, job.endpoint)) {
+        job.error = "Invalid upstream target";
+        return;
+    }
+    kislayphp_bind_endpoint(gateway, job.endpoint);
+    job.ttl_ms = ttl_ms;
+    job.stale_ms = stale_ms;
+    job.generation = generation;
+    kislayphp_resolution_store(job.slot.get(), job);
+}
+
+static void kislayphp_finish_resolve_job(kislayphp_resolve_job &job) {
+    if (job.refresh) {
+        if (job.slot) {
+            job.slot->refreshing.store(false, std::memory_order_release);
+        }
+    } else {
+        job.done.set_value();
+    }
+}
+
+// Runs every queued job on the calling (PHP) thread. The queue is a
+// lock-free LIFO stack that is taken whole and reversed, so jobs run in
+// submission order. Jobs for the same service are coalesced into a single
+// resolver call when the leader's answer came back with a positive TTL,
+// i.e. the resolver declared it cacheable rather than specific to this
+// request; every route of the service then caches it in its slot.
+// Otherwise only identical (method, path) requests share a call.
+static size_t kislayphp_executor_drain(php_kislayphp_gateway_t *gateway) {
+    kislayphp_executor_node *node = gateway->executor_head.exchange(nullptr, std::memory_order_seq_cst);
+    kislayphp_executor_node *ordered = nullptr;
+    size_t taken = 0;
+    while (node != nullptr) {
+        kislayphp_executor_node *next = node->next;
+        node->next = ordered;
+        ordered = node;
+        node = next;
+        ++taken;
+    }
+    gateway->executor_backlog.fetch_sub(taken, std::memory_order_relaxed);
+
+    std::vector<std::shared_ptr<kislayphp_resolve_job>> jobs;
+    while (ordered != nullptr) {
+        kislayphp_executor_node *next = ordered->next;
+        int expected = KISLAYPHP_JOB_PENDING;
+        if (ordered->job->state.compare_exchange_strong(expected, KISLAYPHP_JOB_RUNNING, std::memory_order_acq_rel)) {
+            jobs.push_back(std::move(ordered->job));
+        }
+        delete ordered;
+        ordered = next;
+    }
+
+    std::vector<bool> handled(jobs.size(), false);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (handled[i]) {
+            continue;
+        }
+        kislayphp_resolve_job &leader = *jobs[i];
+        kislayphp_run_resolve_job(gateway, leader);
+        bool route_wide = leader.error == nullptr && leader.ttl_ms > 0;
+        for (size_t j = i + 1; j < jobs.size(); ++j) {
+            kislayphp_resolve_job &follower = *jobs[j];
+            if (handled[j] || follower.service != leader.service) {
+                continue;
+            }
+            if (!route_wide && (follower.method != leader.method || follower.path != leader.path)) {
+                continue;
+            }
+            follower.error = leader.error;
+            follower.error_status = leader.error_status;
+            follower.endpoint = leader.endpoint;
+            follower.ttl_ms = leader.ttl_ms;
+            follower.stale_ms = leader.stale_ms;
+            follower.generation = leader.generation;
+            if (follower.slot != leader.slot && leader.error == nullptr) {
+                kislayphp_resolution_store(follower.slot.get(), follower);
+            }
+            handled[j] = true;
+            gateway->resolver_coalesced.fetch_add(1, std::memory_order_relaxed);
+            kislayphp_finish_resolve_job(follower);
+        }
+        kislayphp_finish_resolve_job(leader);
+    }
+    return jobs.size();
+}
+
+static void kislayphp_executor_submit(php_kislayphp_gateway_t *gateway, std::shared_ptr<kislayphp_resolve_job> job) {
+    auto *node = new kislayphp_executor_node{std::move(job), nullptr};
+    gateway->executor_backlog.fetch_add(1, std::memory_order_relaxed);
+    kislayphp_executor_node *head = gateway->executor_head.load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!gateway->executor_head.compare_exchange_weak(head, node, std::memory_order_seq_cst,
+                                                            std::memory_order_relaxed));
+    // Taking the lock orders this push against the executor's empty check,
+    // so the wakeup cannot be lost.
+    { std::lock_guard<std::mutex> guard(gateway->executor_lock); }
+    gateway->executor_cv.notify_one();
+}
+
+// Claims a queued job that the executor has not picked up, so it will never
+// run. A cancelled refresh releases the route's refresh flag; a cancelled
+// request fails with 503.
+static bool kislayphp_cancel_resolve_job(kislayphp_resolve_job &job) {
+    int expected = KISLAYPHP_JOB_PENDING;
+    if (!job.state.compare_exchange_strong(expected, KISLAYPHP_JOB_CANCELLED, std::memory_order_acq_rel)) {
+        return false;
+    }
+    job.error = "Service resolver unavailable";
+    job.error_status = 503;
+    if (job.refresh && job.slot) {
+        job.slot->refreshing.store(false, std::memory_order_release);
+    }
+    return true;
+}
+
+// Resolves on the PHP thread, which runs queued jobs while it is inside
+// wait(). The resolver is PHP code and is never called from a worker. A job
+// queued between wait() calls waits for the next one until wait_until_ns,
+// and is cancelled then, when the gateway stops, or at once when the queue
+// is full. A refresh is queued and not waited for.
+static void kislayphp_resolve(php_kislayphp_gateway_t *gateway,
+                              const std::shared_ptr<kislayphp_resolve_job> &job,
+                              int64_t wait_until_ns) {
+    if (gateway->executor_closed.load(std::memory_order_acquire)) {
+        kislayphp_cancel_resolve_job(*job);
+        return;
+    }
+    if (!gateway->executor_active.load(std::memory_order_acquire) &&
+        gateway->executor_backlog.load(std::memory_order_relaxed) >= KISLAYPHP_EXECUTOR_BACKLOG) {
+        kislayphp_cancel_resolve_job(*job);
+        gateway->executor_missed.store(true, std::memory_order_relaxed);
+        return;
+    }
+    kislayphp_executor_submit(gateway, job);
+    if (job->refresh) {
+        return;
+    }
+    std::future<void> done = job->done.get_future();
+    while (done.wait_for(std::chrono::milliseconds(20)) != std::future_status::ready) {
+        bool expired = kislayphp_now_ns() >= wait_until_ns;
+        if ((expired || gateway->executor_closed.load(std::memory_order_acquire)) && kislayphp_cancel_resolve_job(*job)) {
+            if (expired && !gateway->executor_active.load(std::memory_order_acquire)) {
+                gateway->executor_missed.store(true, std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+}
+
+// Warns once, on the PHP thread, when requests failed because the script
+// was not inside wait() to run the resolver.
+static void kislayphp_executor_warn(php_kislayphp_gateway_t *gateway) {
+    if (gateway->executor_warned || !gateway->executor_missed.load(std::memory_order_relaxed)) {
+        return;
+    }
+    gateway->executor_warned = true;
+    php_error_docref(nullptr, E_WARNING,
+                     "Resolver requests failed with 503 because no wait() call picked them up; "
+                     "the resolver only runs while the script is inside wait()");
+}
+
+// A script that only sleep()s after listen() gets the warning when the
+// gateway object is destroyed.
+static void kislayphp_gateway_dtor_obj(zend_object *object) {
+    kislayphp_executor_warn(php_kislayphp_gateway_from_obj(object));
+    zend_objects_destroy_object(object);
+}
+
+// Returns the cached endpoint for a service route, or nullptr when the
+// resolver has to run. Sets refresh when the entry is stale and this caller
+// won the right to revalidate it.
+static std::shared_ptr<const kislayphp_resolution> kislayphp_resolution_lookup(php_kislayphp_gateway_t *gateway,
+                                                                              const kislayphp_gateway_route &route,
+                                                                              bool &refresh) {
+    refresh = false;
+    if (!route.resolution) {
+        return nullptr;
+    }
+    std::shared_ptr<const kislayphp_resolution> entry;
+    {
+        std::lock_guard<std::mutex> guard(route.resolution->lock);
+        entry = route.resolution->current;
+    }
+    if (!entry || entry->generation != gateway->resolver_generation.load(std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < entry->fresh_until) {
+        gateway->resolve_hits.fetch_add(1, std::memory_order_relaxed);
+        return entry;
+    }
+    if (now < entry->stale_until) {
+        gateway->resolve_stale.fetch_add(1, std::memory_order_relaxed);
+        refresh = !route.resolution->refreshing.exchange(true, std::memory_order_acq_rel);
+        return entry;
+    }
+    return nullptr;
+}
+
+static bool kislayphp_client_is_http11(const struct mg_request_info *info) {
+    return info != nullptr && info->http_version != nullptr && std::strcmp(info->http_version, "1.1") == 0;
+}
+
+static bool kislayphp_client_keep_alive(struct mg_connection *conn) {
+    const struct mg_request_info *info = mg_get_request_info(conn);
+    if (info == nullptr || info->user_data == nullptr) {
+        return false;
+    }
+    auto *gateway = static_cast<php_kislayphp_gateway_t *>(info->user_data);
+    if (!gateway->keep_alive) {
+        return false;
+    }
+    if (gateway->keep_alive_max_requests > 0) {
+        uintptr_t served = reinterpret_cast<uintptr_t>(mg_get_user_connection_data(conn));
+        if (served >= gateway->keep_alive_max_requests) {
+            return false;
+        }
+    }
+    const char *connection = mg_get_header(conn, "Connection");
+    if (connection != nullptr) {
+        if (kislayphp_header_has_token(connection, "close")) {
+            return false;
+        }
+        if (kislayphp_header_has_token(connection, "keep-alive")) {
+            return true;
+        }
+    }
+    return kislayphp_client_is_http11(info);
+}
+
+static void kislayphp_end_response_head(struct mg_connection *conn, bool keep_alive) {
+    if (!keep_alive) {
+        mg_disable_connection_keep_alive(conn);
+        mg_printf(conn, "Connection: close\r\n\r\n");
+        return;
+    }
+    if (!kislayphp_client_is_http11(mg_get_request_info(conn))) {
+        mg_printf(conn, "Connection: keep-alive\r\n\r\n");
+        return;
+    }
+    mg_printf(conn, "\r\n");
+}
+
+static void kislayphp_send_error(struct mg_connection *conn, int status, const char *message, bool force_close = false) {
+    const char *status_text = "Error";
+    if (status == 400) {
+        status_text = "Bad Request";
+    } else if (status == 404) {
+        status_text = "Not Found";
+    } else if (status == 413) {
+        status_text = "Payload Too Large";
+    } else if (status == 502) {
+        status_text = "Bad Gateway";
+    } else if (status == 503) {
+        status_text = "Service Unavailable";
+    } else if (status == 504) {
+        status_text = "Gateway Timeout";
+    }
+    mg_printf(conn,
+              "HTTP/1.1 %d %s\r\n"
+              "Content-Type: text/plain; charset=utf-8\r\n"
+              "Content-Length: %zu\r\n",
+              status,
+              status_text,
+              std::strlen(message));
+    kislayphp_end_response_head(conn, !force_close && kislayphp_client_keep_alive(conn));
+    mg_write(conn, message, std::strlen(message));
+}
+
+// Builds the request head sent upstream, so it goes out in one write and a
+// hedge attempt can send it without the client connection.
+static std::string kislayphp_format_upstream_request(const struct mg_request_info *info,
+                                                     const kislayphp_gateway_route &route,
+                                                     const kislayphp_endpoint &endpoint,
+                                                     const kislayphp_route_match &params,
+                                                     const std::string &method,
+                                                     const std::string &target_path,
+                                                     bool keep_alive,
+                                                     bool chunked_body,
+                                                     long long budget_ms,
+                                                     const kislayphp_cache_entry *stale) {
+    std::string head;
+    head.reserve(512);
+    head.append(method).append(" ").append(target_path).append(" HTTP/1.1\r\n");
+    head.append("Host: ").append(endpoint.host).append(":").append(std::to_string(endpoint.port)).append("\r\n");
+    head.append("Connection: ").append(keep_alive ? "keep-alive" : "close").append("\r\n");
+
+    bool has_content_length = false;
+    for (int i = 0; i < info->num_headers; ++i) {
+        const char *name = info->http_headers[i].name;
+        const char *value = info->http_headers[i].value;
+        if (name == nullptr || value == nullptr) {
+            continue;
+        }
+        if (::strcasecmp(name, "Host") == 0 || kislayphp_is_hop_header(name)) {
+            continue;
+        }
+        // Clients must not be able to spoof the headers carrying path params.
+        bool param_header = ::strncasecmp(name, "X-Route-Param-", 14) == 0;
+        for (const auto &header : route.param_headers) {
+            if (!header.empty() && ::strcasecmp(name, header.c_str()) == 0) {
+                param_header = true;
+                break;
+            }
+        }
+        if (param_header) {
+            continue;
+        }
+        // The gateway answers the client's 100-continue itself before it
+        // reads the body, so the expectation must not be forwarded upstream.
+        if (::strcasecmp(name, "Expect") == 0) {
+            continue;
+        }
+        // Replaced below by what is left of the (possibly tighter) budget.
+        if (::strcasecmp(name, "X-Request-Deadline") == 0) {
+            continue;
+        }
+        // When revalidating a stored response the validators are the
+        // cache's; the client's conditionals are answered from the cache.
+        if (stale != nullptr && (::strcasecmp(name, "If-None-Match") == 0 || ::strcasecmp(name, "If-Modified-Since") == 0)) {
+            continue;
+        }
+        if (::strcasecmp(name, "Content-Length") == 0) {
+            has_content_length = true;
+        }
+        head.append(name).append(": ").append(value).append("\r\n");
+    }
+
+    for (size_t i = 0; i < params.param_count && i < route.param_headers.size(); ++i) {
+        if (!route.param_headers[i].empty()) {
+            head.append(route.param_headers[i]).append(": ");
+            head.append(params.path + params.param_offset[i], params.param_length[i]).append("\r\n");
+        }
+    }
+
+    if (stale != nullptr && !stale->etag.empty()) {
+        head.append("If-None-Match: ").append(stale->etag).append("\r\n");
+    }
+    if (stale != nullptr && !stale->last_modified.empty()) {
+        head.append("If-Modified-Since: ").append(stale->last_modified).append("\r\n");
+    }
+    if (budget_ms >= 0) {
+        head.append("X-Request-Deadline: ").append(std::to_string(budget_ms)).append("\r\n");
+    }
+    if (chunked_body) {
+        head.append("Transfer-Encoding: chunked\r\n");
+    } else if (!has_content_length && info->content_length >= 0) {
+        head.append("Content-Length: ").append(std::to_string(static_cast<long long>(info->content_length))).append("\r\n");
+    }
+    head.append("\r\n");
+    return head;
+}
+
+static bool kislayphp_response_is_chunked(const struct mg_response_info *resp_info) {
+    if (resp_info == nullptr) {
+        return false;
+    }
+    for (int i = 0; i < resp_info->num_headers; ++i) {
+        const char *name = resp_info->http_headers[i].name;
+        if (name != nullptr && ::strcasecmp(name, "Transfer-Encoding") == 0) {
+            return kislayphp_header_has_token(resp_info->http_headers[i].value, "chunked");
+        }
+    }
+    return false;
+}
+
+static bool kislayphp_response_is_bodyless(const struct mg_response_info *resp_info, bool head_request) {
+    if (head_request || resp_info == nullptr) {
+        return true;
+    }
+    int status = resp_info->status_code;
+    return (status >= 100 && status < 200) || status == 204 || status == 304;
+}
+
+static bool kislayphp_upstream_keeps_alive(const struct mg_response_info *resp_info, bool bodyless) {
+    if (resp_info == nullptr || resp_info->http_version == nullptr) {
+        return false;
+    }
+    if (std::strcmp(resp_info->http_version, "1.1") != 0) {
+        return false;
+    }
+    for (int i = 0; i < resp_info->num_headers; ++i) {
+        const char *name = resp_info->http_headers[i].name;
+        if (name != nullptr && ::strcasecmp(name, "Connection") == 0 &&
+            kislayphp_header_has_token(resp_info->http_headers[i].value, "close")) {
+            return false;
+        }
+    }
+    return bodyless || resp_info->content_length >= 0 || kislayphp_response_is_chunked(resp_info);
+}
+
+// civetweb leaves Expect: 100-continue to callback handlers; a client that
+// waits for the interim response is told to send its body just before the
+// body is first read.
+static void kislayphp_send_continue(struct mg_connection *conn, const struct mg_request_info *info, bool &sent) {
+    if (sent) {
+        return;
+    }
+    sent = true;
+    const char *expect = mg_get_header(conn, "Expect");
+    if (expect != nullptr && ::strcasecmp(expect, "100-continue") == 0 && kislayphp_client_is_http11(info)) {
+        mg_printf(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+}
+
+enum kislayphp_body_result {
+    KISLAYPHP_BODY_OK,
+    KISLAYPHP_BODY_CLIENT_ERROR,
+    KISLAYPHP_BODY_UPSTREAM_ERROR,
+    KISLAYPHP_BODY_TOO_LARGE
+};
+
+static kislayphp_body_result kislayphp_stream_request_body(struct mg_connection *conn,
+                                                           struct mg_connection *target,
+                                                           long long content_length,
+                                                           char *buffer,
+                                                           size_t buffer_size) {
+    long long remaining = content_length;
+    while (remaining > 0) {
+        size_t want = remaining < static_cast<long long>(buffer_size) ? static_cast<size_t>(remaining) : buffer_size;
+        int read_now = mg_read(conn, buffer, want);
+        if (read_now <= 0) {
+            return KISLAYPHP_BODY_CLIENT_ERROR;
+        }
+        if (mg_write(target, buffer, static_cast<size_t>(read_now)) != read_now) {
+            return KISLAYPHP_BODY_UPSTREAM_ERROR;
+        }
+        remaining -= read_now;
+    }
+    return KISLAYPHP_BODY_OK;
+}
+
+// civetweb decodes the client's chunk framing in mg_read; the payload is
+// re-framed as chunks towards the upstream and the body limit is checked as
+// bytes arrive, since there is no Content-Length to reject up front.
+static kislayphp_body_result kislayphp_stream_chunked_body(struct mg_connection *conn,
+                                                           struct mg_connection *target,
+                                                           size_t max_body_bytes,
+                                                           char *buffer,
+                                                           size_t buffer_size) {
+    size_t total = 0;
+    while (true) {
+        int read_now = mg_read(conn, buffer, buffer_size);
+        if (read_now < 0) {
+            return KISLAYPHP_BODY_CLIENT_ERROR;
+        }
+        if (read_now == 0) {
+            break;
+        }
+        total += static_cast<size_t>(read_now);
+        if (max_body_bytes > 0 && total > max_body_bytes) {
+            return KISLAYPHP_BODY_TOO_LARGE;
+        }
+        if (mg_send_chunk(target, buffer, static_cast<unsigned int>(read_now)) < 0) {
+            return KISLAYPHP_BODY_UPSTREAM_ERROR;
+        }
+    }
+    if (mg_send_chunk(target, "", 0) < 0) {
+        return KISLAYPHP_BODY_UPSTREAM_ERROR;
+    }
+    return KISLAYPHP_BODY_OK;
+}
+
+// Parses an X-Request-Deadline value (milliseconds left). Returns -1 when
+// the header is absent or malformed.
+static long long kislayphp_parse_budget(const char *value) {
+    if (value == nullptr) {
+        return -1;
+    }
+    while (*value == ' ') {
+        ++value;
+    }
+    if (!std::isdigit(static_cast<unsigned char>(*value))) {
+        return -1;
+    }
+    char *end = nullptr;
+    long long budget = std::strtoll(value, &end, 10);
+    while (*end == ' ') {
+        ++end;
+    }
+    return *end == '\0' && budget >= 0 ? budget : -1;
+}
+
+static bool kislayphp_request_is_chunked(struct mg_connection *conn, const struct mg_request_info *info) {
+    if (info->content_length >= 0) {
+        return false;
+    }
+    return kislayphp_header_has_token(mg_get_header(conn, "Transfer-Encoding"), "chunked");
+}
+
+// The total budget comes from the route or the gateway default; a caller
+// that sent its own X-Request-Deadline (milliseconds left) can only tighten
+// it. Returns the steady-clock deadline, or 0 when there is none.
+static int64_t kislayphp_request_deadline(php_kislayphp_gateway_t *gateway,
+                                          struct mg_connection *conn,
+                                          const kislayphp_gateway_route &route) {
+    long long budget_ms = route.timeout_ms >= 0 ? route.timeout_ms : gateway->total_timeout_ms;
+    long long caller_ms = kislayphp_parse_budget(mg_get_header(conn, "X-Request-Deadline"));
+    if (caller_ms >= 0 && (budget_ms <= 0 || caller_ms < budget_ms)) {
+        budget_ms = caller_ms;
+    }
+    if (budget_ms <= 0 && caller_ms != 0) {
+        return 0;
+    }
+    return kislayphp_now_ns() + static_cast<int64_t>(budget_ms) * 1000000;
+}
+
+static bool kislayphp_method_is_idempotent(kislayphp_method method) {
+    switch (method) {
+        case KISLAYPHP_METHOD_GET:
+        case KISLAYPHP_METHOD_HEAD:
+        case KISLAYPHP_METHOD_PUT:
+        case KISLAYPHP_METHOD_DELETE:
+        case KISLAYPHP_METHOD_OPTIONS:
+        case KISLAYPHP_METHOD_TRACE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Retry budget: a token bucket shared by all routes, in thousandths of a
+// retry. Every request deposits retry_budget_percent of a retry, time adds
+// retry_min_per_sec so quiet gateways can still retry, and each retry or
+// hedge withdraws a whole one. Extra attempts can thus never add more than
+// the budget percentage of load on top of the traffic that caused them.
+static void kislayphp_retry_deposit(php_kislayphp_gateway_t *gateway, int64_t amount) {
+    const int64_t cap = static_cast<int64_t>(KISLAYPHP_RETRY_TOKEN_CAP) * 1000;
+    int64_t current = gateway->retry_tokens.load(std::memory_order_relaxed);
+    while (current < cap &&
+           !gateway->retry_tokens.compare_exchange_weak(current, std::min(current + amount, cap),
+                                                        std::memory_order_relaxed)) {
+    }
+}
+
+static bool kislayphp_retry_withdraw(php_kislayphp_gateway_t *gateway) {
+    int64_t now_ns = kislayphp_now_ns();
+    int64_t refilled = gateway->retry_refilled.load(std::memory_order_relaxed);
+    int64_t earned = (now_ns - refilled) / 1000000 * gateway->retry_min_per_sec;
+    if (earned > 0 &&
+        gateway->retry_refilled.compare_exchange_strong(refilled, now_ns, std::memory_order_relaxed)) {
+        kislayphp_retry_deposit(gateway, earned);
+    }
+    int64_t current = gateway->retry_tokens.load(std::memory_order_relaxed);
+    while (current >= 1000) {
+        if (gateway->retry_tokens.compare_exchange_weak(current, current - 1000, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Retry state for one client request spread over a target set.
+struct kislayphp_retry_state {
+    php_kislayphp_gateway_t *gateway;
+    kislayphp_target_set *set;
+    struct mg_connection *conn;
+    const struct mg_request_info *info;
+    const kislayphp_route_match *params;
+    const kislayphp_upstream *tried[KISLAYPHP_MAX_RETRIES + 1];
+    size_t tried_count;
+    int retries_left;
+    const kislayphp_endpoint *next;
+};
+
+// Called by kislayphp_proxy_request when an attempt failed before anything
+// reached the client. Picks a different endpoint and pays for the retry;
+// returns false when there is no other endpoint or no budget left.
+static bool kislayphp_retry_next(kislayphp_retry_state &retry, const kislayphp_upstream *failed) {
+    if (retry.retries_left <= 0) {
+        return false;
+    }
+    retry.tried[retry.tried_count++] = failed;
+    const kislayphp_endpoint &next = kislayphp_pick_endpoint(*retry.set, retry.conn, retry.info, *retry.params,
+                                                             retry.tried, retry.tried_count);
+    if (std::find(retry.tried, retry.tried + retry.tried_count, next.upstream) != retry.tried + retry.tried_count) {
+        return false;
+    }
+    if (!kislayphp_retry_withdraw(retry.gateway)) {
+        retry.gateway->retries_denied.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    retry.gateway->retries_done.fetch_add(1, std::memory_order_relaxed);
+    --retry.retries_left;
+    retry.next = &next;
+    return true;
+}
+
+// Finds a directive of a Cache-Control style header. seconds receives its
+// numeric argument, or -1 when it has none.
+static bool kislayphp_header_directive(const char *value, const char *name, long long &seconds) {
+    if (value == nullptr) {
+        return false;
+    }
+    size_t name_len = std::strlen(name);
+    const char *p = value;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+        }
+        const char *start = p;
+        while (*p != '\0' && *p != ',' && *p != '=' && *p != ' ' && *p != '\t') {
+            ++p;
+        }
+        bool match = static_cast<size_t>(p - start) == name_len && ::strncasecmp(start, name, name_len) == 0;
+        while (*p == ' ' || *p == '\t') {
+            ++p;
+        }
+        seconds = -1;
+        if (*p == '=') {
+            ++p;
+            bool quoted = *p == '"';
+            p += quoted ? 1 : 0;
+            if (std::isdigit(static_cast<unsigned char>(*p))) {
+                seconds = std::strtoll(p, nullptr, 10);
+            }
+            while (*p != '\0' && (quoted ? *p != '"' : *p != ',')) {
+                ++p;
+            }
+            p += quoted && *p == '"' ? 1 : 0;
+        }
+        if (match) {
+            return true;
+        }
+        while (*p != '\0' && *p != ',') {
+            ++p;
+        }
+    }
+    return false;
+}
+
+static const char *kislayphp_response_header(const struct mg_response_info *resp_info, const char *name) {
+    for (int i = 0; resp_info != nullptr && i < resp_info->num_headers; ++i) {
+        const char *header = resp_info->http_headers[i].name;
+        if (header != nullptr && ::strcasecmp(header, name) == 0) {
+            return resp_info->http_headers[i].value;
+        }
+    }
+    return nullptr;
+}
+
+// Seconds since the epoch of an IMF-fixdate, or -1.
+static long long kislayphp_parse_http_date(const char *value) {
+    if (value == nullptr) {
+        return -1;
+    }
+    struct tm parsed;
+    std::memset(&parsed, 0, sizeof(parsed));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &parsed);
+    if (end == nullptr) {
+        return -1;
+    }
+    return static_cast<long long>(timegm(&parsed));
+}
+
+enum kislayphp_cache_use {
+    KISLAYPHP_CACHE_BYPASS,
+    // The client asked for a fresh answer; it may still be stored.
+    KISLAYPHP_CACHE_REFRESH,
+    KISLAYPHP_CACHE_LOOKUP,
+};
+
+// Shared-cache rules for the request side: only bodyless GET/HEAD requests
+// without credentials take part.
+static kislayphp_cache_use kislayphp_cache_usage(php_kislayphp_gateway_t *gateway,
+                                                 struct mg_connection *conn,
+                                                 const struct mg_request_info *info,
+                                                 const kislayphp_gateway_route &route) {
+    if (!route.cache || !gateway->cache || info->request_method == nullptr) {
+        return KISLAYPHP_CACHE_BYPASS;
+    }
+    if (std::strcmp(info->request_method, "GET") != 0 && std::strcmp(info->request_method, "HEAD") != 0) {
+        return KISLAYPHP_CACHE_BYPASS;
+    }
+    if (info->content_length > 0 || kislayphp_request_is_chunked(conn, info) ||
+        mg_get_header(conn, "Authorization") != nullptr) {
+        return KISLAYPHP_CACHE_BYPASS;
+    }
+    const char *cache_control = mg_get_header(conn, "Cache-Control");
+    long long seconds = -1;
+    if (kislayphp_header_directive(cache_control, "no-store", seconds)) {
+        return KISLAYPHP_CACHE_BYPASS;
+    }
+    if (kislayphp_header_directive(cache_control, "no-cache", seconds) ||
+        (kislayphp_header_directive(cache_control, "max-age", seconds) && seconds == 0) ||
+        (cache_control == nullptr && kislayphp_header_has_token(mg_get_header(conn, "Pragma"), "no-cache"))) {
+        return KISLAYPHP_CACHE_REFRESH;
+    }
+    return KISLAYPHP_CACHE_LOOKUP;
+}
+
+// Cache key: the path and query the request is proxied with.
+static std::string kislayphp_cache_key(const struct mg_request_info *info) {
+    std::string key = info->local_uri ? info->local_uri : (info->request_uri ? info->request_uri : "/");
+    if (info->query_string && *info->query_string) {
+        key.append("?");
+        key.append(info->query_string);
+    }
+    return key;
+}
+
+static kislayphp_cache_shard &kislayphp_cache_shard_for(kislayphp_response_cache &cache, const std::string &key) {
+    return *cache.shards[std::hash<std::string>()(key) % cache.shards.size()];
+}
+
+static bool kislayphp_cache_vary_matches(const std::vector<std::pair<std::string, std::string>> &values,
+                                         struct mg_connection *conn) {
+    for (const auto &vary : values) {
+        const char *value = mg_get_header(conn, vary.first.c_str());
+        if (vary.second != (value != nullptr ? value : "")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void kislayphp_cache_drop(kislayphp_cache_shard &shard,
+                                 std::unordered_map<std::string, kislayphp_cache_slot>::iterator slot) {
+    for (const auto &tag : slot->second.tags) {
+        auto indexed = shard.tags.find(tag);
+        if (indexed != shard.tags.end()) {
+            indexed->second.erase(&slot->first);
+            if (indexed->second.empty()) {
+                shard.tags.erase(indexed);
+            }
+        }
+    }
+    shard.bytes -= slot->second.bytes;
+    shard.lru.erase(slot->second.lru);
+    shard.slots.erase(slot);
+}
+
+static size_t kislayphp_cache_entry_bytes(const std::string &key, const kislayphp_cache_entry &entry) {
+    return key.size() + entry.blob.size() + sizeof(kislayphp_cache_entry) + 64;
+}
+
+// Returns the variant stored for key that matches the request's Vary
+// headers. It may have expired if it carries a validator; expired variants
+// without one are dropped on the way.
+static std::shared_ptr<const kislayphp_cache_entry> kislayphp_cache_lookup(kislayphp_response_cache &cache,
+                                                                         const std::string &key,
+                                                                         struct mg_connection *conn,
+                                                                         int64_t now_ns) {
+    kislayphp_cache_shard &shard = kislayphp_cache_shard_for(cache, key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto slot = shard.slots.find(key);
+    if (slot == shard.slots.end()) {
+        return nullptr;
+    }
+    std::shared_ptr<const kislayphp_cache_entry> found;
+    auto &variants = slot->second.variants;
+    for (size_t i = 0; i < variants.size();) {
+        if (variants[i]->expires_ns <= now_ns && variants[i]->etag.empty() && variants[i]->last_modified.empty()) {
+            size_t bytes = kislayphp_cache_entry_bytes(key, *variants[i]);
+            slot->second.bytes -= bytes;
+            shard.bytes -= bytes;
+            variants.erase(variants.begin() + static_cast<std::ptrdiff_t>(i));
+            continue;
+        }
+        if (!found && kislayphp_cache_vary_matches(variants[i]->vary, conn)) {
+            found = variants[i];
+        }
+        ++i;
+    }
+    if (variants.empty()) {
+        kislayphp_cache_drop(shard, slot);
+    } else if (found) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, slot->second.lru);
+    }
+    return found;
+}
+
+static void kislayphp_cache_insert(kislayphp_response_cache &cache,
+                                   const std::string &key,
+                                   std::shared_ptr<const kislayphp_cache_entry> entry) {
+    size_t bytes = kislayphp_cache_entry_bytes(key, *entry);
+    if (bytes > cache.shard_budget) {
+        return;
+    }
+    kislayphp_cache_shard &shard = kislayphp_cache_shard_for(cache, key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto inserted = shard.slots.emplace(key, kislayphp_cache_slot());
+    kislayphp_cache_slot &slot = inserted.first->second;
+    if (inserted.second) {
+        slot.lru = shard.lru.insert(shard.lru.begin(), &inserted.first->first);
+    } else {
+        shard.lru.splice(shard.lru.begin(), shard.lru, slot.lru);
+    }
+    // A variant for the same Vary values is replaced; past eight variants
+    // the oldest goes.
+    auto &variants = slot.variants;
+    for (size_t i = 0; i < variants.size(); ++i) {
+        if (variants[i]->vary == entry->vary || variants.size() >= 8) {
+            size_t old = kislayphp_cache_entry_bytes(key, *variants[i]);
+            slot.bytes -= old;
+            shard.bytes -= old;
+            variants.erase(variants.begin() + static_cast<std::ptrdiff_t>(i));
+            break;
+        }
+    }
+    for (const auto &tag : entry->tags) {
+        if (std::find(slot.tags.begin(), slot.tags.end(), tag) == slot.tags.end()) {
+            slot.tags.push_back(tag);
+        }
+        shard.tags[tag].insert(&inserted.first->first);
+    }
+    variants.push_back(std::move(entry));
+    slot.bytes += bytes;
+    shard.bytes += bytes;
+    while (shard.bytes > cache.shard_budget && shard.lru.size() > 1) {
+        kislayphp_cache_drop(shard, shard.slots.find(*shard.lru.back()));
+        cache.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    cache.stores.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Identifies one response across both tiers: its cache key and the request
+// header values it varies on.
+static std::string kislayphp_cache_variant_id(const std::string &key, const kislayphp_cache_entry &entry) {
+    std::string id = key;
+    for (const auto &vary : entry.vary) {
+        id.append(1, '\0').append(vary.first).append(1, '\0').append(vary.second);
+    }
+    return id;
+}
+
+// Removes every stored variant tagged with one of tags, through the shards'
+// tag indexes, and adds their ids to purged.
+static void kislayphp_cache_purge_tags(kislayphp_response_cache &cache,
+                                       const std::vector<std::string> &tags,
+                                       std::unordered_set<std::string> &purged) {
+    for (auto &shard : cache.shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        for (const auto &tag : tags) {
+            auto indexed = shard->tags.find(tag);
+            if (indexed == shard->tags.end()) {
+                continue;
+            }
+            std::vector<const std::string *> keys(indexed->second.begin(), indexed->second.end());
+            shard->tags.erase(indexed);
+            for (const std::string *key : keys) {
+                auto slot = shard->slots.find(*key);
+                auto &variants = slot->second.variants;
+                for (size_t i = 0; i < variants.size();) {
+                    const auto &entry_tags = variants[i]->tags;
+                    if (std::find(entry_tags.begin(), entry_tags.end(), tag) == entry_tags.end()) {
+                        ++i;
+                        continue;
+                    }
+                    size_t bytes = kislayphp_cache_entry_bytes(*key, *variants[i]);
+                    slot->second.bytes -= bytes;
+                    shard->bytes -= bytes;
+                    purged.insert(kislayphp_cache_variant_id(*key, *variants[i]));
+                    variants.erase(variants.begin() + static_cast<std::ptrdiff_t>(i));
+                }
+                if (variants.empty()) {
+                    kislayphp_cache_drop(*shard, slot);
+                }
+            }
+        }
+    }
+}
+
+// Finds a chunk of slab_class for a new record: a free one, one of a page
+// given to the class now, or else the class's next chunk in turn, whose
+// record is dropped. Pages keep their class once given one.
+static bool kislayphp_disk_allocate(kislayphp_disk_tier &tier,
+                                    kislayphp_disk_shard &shard,
+                                    uint8_t slab_class,
+                                    uint64_t &offset) {
+    kislayphp_disk_class &cls = shard.classes[slab_class];
+    size_t chunk = kislayphp_disk_chunk_bytes(slab_class);
+    if (cls.free.empty() && !shard.unassigned.empty()) {
+        uint64_t page = shard.unassigned.back();
+        shard.unassigned.pop_back();
+        kislayphp_disk_page_table(tier)[page - 1] = slab_class;
+        cls.pages.push_back(page);
+        for (size_t at = KISLAYPHP_DISK_PAGE_BYTES; at >= chunk; at -= chunk) {
+            cls.free.push_back(page * KISLAYPHP_DISK_PAGE_BYTES + at - chunk);
+        }
+    }
+    if (cls.free.empty()) {
+        if (cls.pages.empty()) {
+            return false;
+        }
+        size_t per_page = KISLAYPHP_DISK_PAGE_BYTES / chunk;
+        cls.hand %= cls.pages.size() * per_page;
+        kislayphp_disk_release(tier, shard, cls.pages[cls.hand / per_page] * KISLAYPHP_DISK_PAGE_BYTES + (cls.hand % per_page) * chunk);
+        ++cls.hand;
+    }
+    offset = cls.free.back();
+    cls.free.pop_back();
+    return true;
+}
+
+// Writes entry to the persistent tier, replacing the record stored for the
+// same key and Vary values. Entries larger than a page stay memory-only.
+static void kislayphp_disk_store(kislayphp_disk_tier &tier,
+                                 const std::string &key,
+                                 const kislayphp_cache_entry &entry,
+                                 int64_t now_ns) {
+    std::string meta = kislayphp_disk_meta(entry);
+    size_t payload = key.size() + meta.size() + entry.blob.size();
+    if (sizeof(kislayphp_disk_record) + payload > KISLAYPHP_DISK_PAGE_BYTES) {
+        return;
+    }
+    uint8_t slab_class = 0;
+    while (kislayphp_disk_chunk_bytes(slab_class) < sizeof(kislayphp_disk_record) + payload) {
+        ++slab_class;
+    }
+    int64_t wall_ms = kislayphp_wall_ms();
+
+    kislayphp_disk_shard &shard = *tier.shards[kislayphp_disk_key_shard(tier, key)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto indexed = shard.index.find(key);
+    if (indexed != shard.index.end()) {
+        // Replaces the variant with the same Vary values, and the oldest
+        // one once the key has eight.
+        const auto &variants = indexed->second;
+        std::vector<uint64_t> replaced;
+        for (size_t i = 0; i < variants.size(); ++i) {
+            if (variants[i].vary == entry.vary || (i == 0 && variants.size() >= 8)) {
+                replaced.push_back(variants[i].offset);
+            }
+        }
+        for (uint64_t offset : replaced) {
+            kislayphp_disk_release(tier, shard, offset);
+        }
+    }
+    uint64_t offset = 0;
+    if (!kislayphp_disk_allocate(tier, shard, slab_class, offset)) {
+        return;
+    }
+    kislayphp_disk_record *record = kislayphp_disk_record_at(tier, offset);
+    record->magic = 0;
+    char *out = reinterpret_cast<char *>(record + 1);
+    std::memcpy(out, key.data(), key.size());
+    std::memcpy(out + key.size(), meta.data(), meta.size());
+    std::memcpy(out + key.size() + meta.size(), entry.blob.data(), entry.blob.size());
+    record->key_len = static_cast<uint32_t>(key.size());
+    record->meta_len = static_cast<uint32_t>(meta.size());
+    record->blob_len = static_cast<uint32_t>(entry.blob.size());
+    record->stored_ms = wall_ms - (now_ns - entry.stored_ns) / 1000000;
+    record->expires_ms = wall_ms + (entry.expires_ns - now_ns) / 1000000;
+    record->checksum = kislayphp_disk_checksum(*record, payload);
+    // Published last: a record torn by a crash fails its checksum on load.
+    record->magic = KISLAYPHP_DISK_RECORD_MAGIC;
+    kislayphp_disk_index(shard, key, entry, offset);
+    tier.writes.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The persistent tier's counterpart of kislayphp_cache_lookup.
+static std::shared_ptr<const kislayphp_cache_entry> kislayphp_disk_lookup(kislayphp_disk_tier &tier,
+                                                                        const std::string &key,
+                                                                        struct mg_connection *conn,
+                                                                        int64_t now_ns) {
+    int64_t wall_ms = kislayphp_wall_ms();
+    kislayphp_disk_shard &shard = *tier.shards[kislayphp_disk_key_shard(tier, key)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto indexed = shard.index.find(key);
+    if (indexed == shard.index.end()) {
+        return nullptr;
+    }
+    std::vector<uint64_t> offsets;
+    for (const auto &variant : indexed->second) {
+        if (kislayphp_cache_vary_matches(variant.vary, conn)) {
+            offsets.push_back(variant.offset);
+        }
+    }
+    for (uint64_t offset : offsets) {
+        auto entry = std::make_shared<kislayphp_cache_entry>();
+        std::string stored_key;
+        kislayphp_disk_decode(tier, offset, stored_key, *entry, now_ns, wall_ms);
+        if (entry->expires_ns <= now_ns && entry->etag.empty() && entry->last_modified.empty()) {
+            kislayphp_disk_release(tier, shard, offset);
+            continue;
+        }
+        const kislayphp_disk_record *record = kislayphp_disk_record_at(tier, offset);
+        entry->blob.assign(reinterpret_cast<const char *>(record + 1) + record->key_len + record->meta_len, record->blob_len);
+        tier.hits.fetch_add(1, std::memory_order_relaxed);
+        return entry;
+    }
+    return nullptr;
+}
+
+// The persistent tier's counterpart of kislayphp_cache_purge_tags.
+static void kislayphp_disk_purge_tags(kislayphp_disk_tier &tier,
+                                      const std::vector<std::string> &tags,
+                                      std::unordered_set<std::string> &purged) {
+    for (auto &shard : tier.shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        for (const auto &tag : tags) {
+            auto tagged = shard->tags.find(tag);
+            if (tagged == shard->tags.end()) {
+                continue;
+            }
+            std::vector<uint64_t> offsets(tagged->second.begin(), tagged->second.end());
+            for (uint64_t offset : offsets) {
+                std::string key;
+                kislayphp_cache_entry entry;
+                kislayphp_disk_decode(tier, offset, key, entry, 0, 0);
+                purged.insert(kislayphp_cache_variant_id(key, entry));
+                kislayphp_disk_release(tier, *shard, offset);
+            }
+        }
+    }
+}
+
+// Stores entry in memory and, when there is one, in the persistent tier.
+static void kislayphp_cache_store(kislayphp_response_cache &cache,
+                                  const std::string &key,
+                                  std::shared_ptr<const kislayphp_cache_entry> entry) {
+    if (cache.disk) {
+        kislayphp_disk_store(*cache.disk, key, *entry, kislayphp_now_ns());
+    }
+    kislayphp_cache_insert(cache, key, std::move(entry));
+}
+
+// Looks key up in memory, then in the persistent tier; entries found on
+// disk are brought back into memory.
+static std::shared_ptr<const kislayphp_cache_entry> kislayphp_cache_find(kislayphp_response_cache &cache,
+                                                                       const std::string &key,
+                                                                       struct mg_connection *conn,
+                                                                       int64_t now_ns) {
+    std::shared_ptr<const kislayphp_cache_entry> entry = kislayphp_cache_lookup(cache, key, conn, now_ns);
+    if (entry || !cache.disk) {
+        return entry;
+    }
+    entry = kislayphp_disk_lookup(*cache.disk, key, conn, now_ns);
+    if (entry) {
+        kislayphp_cache_insert(cache, key, entry);
+    }
+    return entry;
+}
+
+static bool kislayphp_cache_contains(kislayphp_response_cache &cache, const std::string &key) {
+    kislayphp_cache_shard &shard = kislayphp_cache_shard_for(cache, key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.slots.find(key) != shard.slots.end();
+}
+
+void kislayphp_cache_flight_lead::release() {
+    if (worker != nullptr) {
+        worker->flight = nullptr;
+        worker = nullptr;
+    }
+    if (!flight) {
+        return;
+    }
+    bool stored = kislayphp_cache_contains(*cache, key);
+    {
+        std::lock_guard<std::mutex> guard(cache->flight_lock);
+        flight->done = true;
+        cache->flights.erase(key);
+        if (!stored) {
+            int64_t now_ns = kislayphp_now_ns();
+            if (cache->passes.size() >= KISLAYPHP_CACHE_PASS_KEYS) {
+                for (auto it = cache->passes.begin(); it != cache->passes.end();) {
+                    it = it->second <= now_ns ? cache->passes.erase(it) : std::next(it);
+                }
+            }
+            if (cache->passes.size() < KISLAYPHP_CACHE_PASS_KEYS) {
+                cache->passes[key] = now_ns + KISLAYPHP_CACHE_PASS_NS;
+            }
+        } else {
+            cache->passes.erase(key);
+        }
+    }
+    flight->cv.notify_all();
+    flight.reset();
+}
+
+// Releases the requests waiting on the fetch this worker's request leads.
+static void kislayphp_cache_flight_settle(struct mg_connection *conn) {
+    auto *worker = static_cast<kislayphp_worker_state *>(mg_get_thread_pointer(conn));
+    if (worker != nullptr && worker->flight != nullptr) {
+        worker->flight->release();
+    }
+}
+
+// Weak comparison of an entity tag against an If-None-Match list.
+static bool kislayphp_etag_matches(const char *list, const std::string &etag) {
+    auto opaque = [](const char *tag, size_t len) {
+        if (len >= 2 && tag[0] == 'W' && tag[1] == '/') {
+            tag += 2;
+            len -= 2;
+        }
+        return std::string(tag, len);
+    };
+    std::string stored = opaque(etag.data(), etag.size());
+    const char *p = list;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+        }
+        if (*p == '*') {
+            return true;
+        }
+        const char *start = p;
+        if (p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if (*p == '"') {
+            const char *close = std::strchr(p + 1, '"');
+            p = close != nullptr ? close + 1 : p + std::strlen(p);
+        } else {
+            while (*p != '\0' && *p != ',') {
+                ++p;
+            }
+        }
+        if (p > start && opaque(start, static_cast<size_t>(p - start)) == stored) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether the client's conditional headers match the stored response, so
+// that it can be answered with 304. If-None-Match takes precedence.
+static bool kislayphp_cache_not_modified(struct mg_connection *conn, const kislayphp_cache_entry &entry) {
+    if (entry.status != 200) {
+        return false;
+    }
+    if (const char *if_none_match = mg_get_header(conn, "If-None-Match")) {
+        return !entry.etag.empty() && kislayphp_etag_matches(if_none_match, entry.etag);
+    }
+    const char *if_modified_since = mg_get_header(conn, "If-Modified-Since");
+    if (if_modified_since == nullptr || entry.last_modified.empty()) {
+        return false;
+    }
+    long long since = kislayphp_parse_http_date(if_modified_since);
+    long long modified = kislayphp_parse_http_date(entry.last_modified.c_str());
+    return since >= 0 && modified >= 0 && modified <= since;
+}
+
+// Calls fn(name, value, line) for each header line stored in entry's head.
+template <typename Fn>
+static void kislayphp_cache_each_header(const kislayphp_cache_entry &entry, Fn fn) {
+    size_t pos = entry.blob.find("\r\n") + 2;
+    while (pos + 2 < entry.head_len) {
+        size_t end = entry.blob.find("\r\n", pos);
+        size_t colon = entry.blob.find(':', pos);
+        if (colon < end) {
+            size_t value = entry.blob.find_first_not_of(' ', colon + 1);
+            fn(std::string(entry.blob, pos, colon - pos), std::string(entry.blob, value, end - std::min(value, end)),
+               std::string(entry.blob, pos, end + 2 - pos));
+        }
+        pos = end + 2;
+    }
+}
+
+// Writes a stored response to the client, or 304 when the client already
+// has it. HTTP/1.1 keep-alive clients whose response fits the relay buffer
+// get it in a single write.
+static void kislayphp_cache_write(struct mg_connection *conn,
+                                  const struct mg_request_info *info,
+                                  const kislayphp_cache_entry &entry,
+                                  int64_t now_ns) {
+    // The stored Age value is ten spaces wide; the right-aligned age fits it
+    // as optional whitespace plus digits.
+    char age[16];
+    long long seconds = entry.initial_age + (now_ns - entry.stored_ns) / 1000000000;
+    std::snprintf(age, sizeof(age), "%10lld", std::max(0LL, std::min(seconds, 9999999999LL)));
+    bool head_only = std::strcmp(info->request_method, "HEAD") == 0;
+    size_t length = head_only ? entry.head_len : entry.blob.size();
+    bool keep_alive = kislayphp_client_keep_alive(conn);
+    if (kislayphp_cache_not_modified(conn, entry)) {
+        std::string head("HTTP/1.1 304 Not Modified\r\nAge: ");
+        head.append(std::to_string(std::max(0LL, seconds))).append("\r\n");
+        kislayphp_cache_each_header(entry, [&head](const std::string &name, const std::string &, const std::string &line) {
+            static const char *const kept[] = {"Cache-Control", "Content-Location", "Date", "ETag",
+                                               "Expires", "Last-Modified", "Vary", "X-Cache"};
+            for (const char *header : kept) {
+                if (::strcasecmp(name.c_str(), header) == 0) {
+                    head.append(line);
+                    break;
+                }
+            }
+        });
+        mg_write(conn, head.data(), head.size());
+        kislayphp_end_response_head(conn, keep_alive);
+        return;
+    }
+    auto *worker = static_cast<kislayphp_worker_state *>(mg_get_thread_pointer(conn));
+    if (keep_alive && kislayphp_client_is_http11(info) && worker != nullptr && length <= worker->relay_buffer.size()) {
+        char *out = worker->relay_buffer.data();
+        std::memcpy(out, entry.blob.data(), length);
+        std::memcpy(out + entry.age_offset, age, 10);
+        mg_write(conn, out, length);
+        return;
+    }
+    // The stored head ends in the blank line; it is left off so the
+    // connection header this client needs can go first.
+    std::string head(entry.blob, 0, entry.head_len - 2);
+    head.replace(entry.age_offset, 10, age, 10);
+    mg_write(conn, head.data(), head.size());
+    kislayphp_end_response_head(conn, keep_alive);
+    if (!head_only) {
+        mg_write(conn, entry.blob.data() + entry.head_len, entry.blob.size() - entry.head_len);
+    }
+}
+
+// Answers the request from the cache when a fresh variant is stored. A
+// stored variant that has expired but carries a validator is left in stale
+// for the upstream request to revalidate; so is any variant with a
+// validator when the client asked for a fresh answer.
+// On a GET miss the request either leads the upstream fetch for its key, or, when
+// an identical GET is already fetching it, waits for that one and is served
+// the stored copy (single-flight). Waiters whose response turns out not to
+// be stored, or not to match their Vary headers, go upstream themselves, and
+// keys that stored nothing are not coalesced again for a few seconds.
+static bool kislayphp_cache_serve(php_kislayphp_gateway_t *gateway,
+                                  struct mg_connection *conn,
+                                  const struct mg_request_info *info,
+                                  const kislayphp_gateway_route &route,
+                                  kislayphp_cache_flight_lead &lead,
+                                  std::shared_ptr<const kislayphp_cache_entry> &stale) {
+    kislayphp_cache_use use = kislayphp_cache_usage(gateway, conn, info, route);
+    if (use == KISLAYPHP_CACHE_BYPASS) {
+        return false;
+    }
+    kislayphp_response_cache &cache = *gateway->cache;
+    std::string key = kislayphp_cache_key(info);
+    int64_t now_ns = kislayphp_now_ns();
+    std::shared_ptr<const kislayphp_cache_entry> entry = kislayphp_cache_find(cache, key, conn, now_ns);
+    if (use == KISLAYPHP_CACHE_REFRESH) {
+        if (entry && (!entry->etag.empty() || !entry->last_modified.empty())) {
+            stale = std::move(entry);
+        }
+        return false;
+    }
+    if (entry && entry->expires_ns > now_ns) {
+        cache.hits.fetch_add(1, std::memory_order_relaxed);
+        kislayphp_cache_write(conn, info, *entry, now_ns);
+        return true;
+    }
+    stale = std::move(entry);
+    if (std::strcmp(info->request_method, "GET") != 0) {
+        cache.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::shared_ptr<kislayphp_cache_flight> flight;
+    {
+        std::unique_lock<std::mutex> guard(cache.flight_lock);
+        auto pass = cache.passes.find(key);
+        if (pass != cache.passes.end()) {
+            if (pass->second > now_ns) {
+                cache.misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            cache.passes.erase(pass);
+        }
+        auto inserted = cache.flights.emplace(key, nullptr);
+        if (inserted.second) {
+            inserted.first->second = std::make_shared<kislayphp_cache_flight>();
+            lead.cache = gateway->cache;
+            lead.key = std::move(key);
+            lead.flight = inserted.first->second;
+            lead.worker = static_cast<kislayphp_worker_state *>(mg_get_thread_pointer(conn));
+            if (lead.worker != nullptr) {
+                lead.worker->flight = &lead;
+            }
+            cache.misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        // Waits at most the first-byte timeout, or less if the request's
+        // deadline is sooner, before going upstream itself.
+        flight = inserted.first->second;
+        int first_byte_ms = route.first_byte_timeout_ms > 0 ? route.first_byte_timeout_ms : gateway->first_byte_timeout_ms;
+        int64_t wait_until_ns = now_ns + static_cast<int64_t>(first_byte_ms) * 1000000;
+        int64_t deadline_ns = kislayphp_request_deadline(gateway, conn, route);
+        if (deadline_ns > 0) {
+            wait_until_ns = std::min(wait_until_ns, deadline_ns);
+        }
+        flight->cv.wait_for(guard, std::chrono::nanoseconds(std::max<int64_t>(wait_until_ns - now_ns, 0)),
+                            [&flight]() { return flight->done; });
+    }
+    now_ns = kislayphp_now_ns();
+    entry = kislayphp_cache_find(cache, key, conn, now_ns);
+    if (!entry || entry->expires_ns <= now_ns) {
+        stale = std::move(entry);
+        cache.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    cache.coalesced.fetch_add(1, std::memory_order_relaxed);
+    kislayphp_cache_write(conn, info, *entry, now_ns);
+    return true;
+}
+
+// A response being relayed that is to be stored once its body is complete.
+struct kislayphp_cache_fill {
+    bool active = false;
+    long long ttl = 0;
+    long long age = 0;
+    std::vector<std::pair<std::string, std::string>> vary;
+    std::string body;
+};
+
+// Freshness lifetime in seconds a response gives itself through
+// Cache-Control s-maxage/max-age or Expires, or -1 if it gives none.
+static long long kislayphp_cache_lifetime(const struct mg_response_info *resp_info) {
+    const char *cache_control = kislayphp_response_header(resp_info, "Cache-Control");
+    long long seconds = -1;
+    if (kislayphp_header_directive(cache_control, "s-maxage", seconds) ||
+        kislayphp_header_directive(cache_control, "max-age", seconds)) {
+        return std::max(seconds, 0LL);
+    }
+    if (const char *expires = kislayphp_response_header(resp_info, "Expires")) {
+        long long at = kislayphp_parse_http_date(expires);
+        long long date = kislayphp_parse_http_date(kislayphp_response_header(resp_info, "Date"));
+        return at < 0 ? 0 : std::max(at - (date >= 0 ? date : static_cast<long long>(std::time(nullptr))), 0LL);
+    }
+    return -1;
+}
+
+static long long kislayphp_response_age(const struct mg_response_info *resp_info) {
+    const char *age = kislayphp_response_header(resp_info, "Age");
+    return age != nullptr && std::isdigit(static_cast<unsigned char>(*age)) ? std::strtoll(age, nullptr, 10) : 0;
+}
+
+// Shared-cache rules for the response side. Responses must say how long
+// they stay fresh (Cache-Control s-maxage/max-age or Expires) unless the
+// route gives 200s a default TTL.
+static bool kislayphp_cache_fill_start(php_kislayphp_gateway_t *gateway,
+                                       struct mg_connection *conn,
+                                       const struct mg_request_info *info,
+                                       const kislayphp_gateway_route &route,
+                                       const struct mg_response_info *resp_info,
+                                       kislayphp_cache_fill &fill) {
+    if (resp_info == nullptr || std::strcmp(info->request_method, "GET") != 0 ||
+        kislayphp_cache_usage(gateway, conn, info, route) == KISLAYPHP_CACHE_BYPASS) {
+        return false;
+    }
+    int status = resp_info->status_code;
+    if (status != 200 && status != 203 && status != 204 && status != 301 && status != 404 && status != 410) {
+        return false;
+    }
+    if (kislayphp_response_header(resp_info, "Set-Cookie") != nullptr) {
+        return false;
+    }
+    const char *cache_control = kislayphp_response_header(resp_info, "Cache-Control");
+    long long seconds = -1;
+    if (kislayphp_header_directive(cache_control, "no-store", seconds) ||
+        kislayphp_header_directive(cache_control, "private", seconds) ||
+        kislayphp_header_directive(cache_control, "no-cache", seconds)) {
+        return false;
+    }
+    long long ttl = kislayphp_cache_lifetime(resp_info);
+    if (ttl < 0 && status == 200) {
+        ttl = route.cache_ttl;
+    }
+    fill.age = kislayphp_response_age(resp_info);
+    if (ttl - fill.age <= 0) {
+        return false;
+    }
+    if (!kislayphp_response_is_chunked(resp_info) && resp_info->content_length > 0 &&
+        static_cast<unsigned long long>(resp_info->content_length) > route.cache_max_entry_bytes) {
+        return false;
+    }
+    fill.vary.clear();
+    for (int i = 0; i < resp_info->num_headers; ++i) {
+        const char *name = resp_info->http_headers[i].name;
+        if (name == nullptr || ::strcasecmp(name, "Vary") != 0 || resp_info->http_headers[i].value == nullptr) {
+            continue;
+        }
+        const char *p = resp_info->http_headers[i].value;
+        while (*p != '\0') {
+            while (*p == ' ' || *p == '\t' || *p == ',') {
+                ++p;
+            }
+            const char *start = p;
+            while (*p != '\0' && *p != ',' && *p != ' ' && *p != '\t') {
+                ++p;
+            }
+            std::string header(start, static_cast<size_t>(p - start));
+            if (header == "*") {
+                return false;
+            }
+            if (!header.empty()) {
+                const char *value = mg_get_header(conn, header.c_str());
+                fill.vary.emplace_back(header, value != nullptr ? value : "");
+            }
+        }
+    }
+    fill.ttl = ttl;
+    fill.body.clear();
+    fill.active = true;
+    return true;
+}
+
+// Surrogate keys are addressed to the cache; they are indexed, not stored
+// or passed on.
+static bool kislayphp_is_surrogate_header(const char *name) {
+    return ::strcasecmp(name, "Surrogate-Key") == 0 || ::strcasecmp(name, "Cache-Tag") == 0;
+}
+
+static bool kislayphp_cache_skips_header(const char *name) {
+    return kislayphp_is_hop_header(name) || ::strcasecmp(name, "Content-Length") == 0 ||
+           ::strcasecmp(name, "Age") == 0 || ::strcasecmp(name, "X-Cache") == 0;
+}
+
+// Serialises a response into the form it is stored and served in.
+static std::shared_ptr<kislayphp_cache_entry> kislayphp_cache_build(
+    int status,
+    const std::string &status_text,
+    const std::vector<std::pair<std::string, std::string>> &headers,
+    const char *body,
+    size_t body_len) {
+    auto entry = std::make_shared<kislayphp_cache_entry>();
+    std::string &blob = entry->blob;
+    blob.reserve(512 + body_len);
+    blob.append("HTTP/1.1 ").append(std::to_string(status)).append(" ").append(status_text).append("\r\nAge: ");
+    entry->age_offset = blob.size();
+    blob.append("         0\r\n");
+    for (const auto &header : headers) {
+        if (kislayphp_cache_skips_header(header.first.c_str())) {
+            continue;
+        }
+        if (kislayphp_is_surrogate_header(header.first.c_str())) {
+            // Surrogate-Key separates keys with spaces, Cache-Tag with commas.
+            const char *p = header.second.c_str();
+            while (*p != '\0') {
+                while (*p == ' ' || *p == '\t' || *p == ',') {
+                    ++p;
+                }
+                const char *start = p;
+                while (*p != '\0' && *p != ' ' && *p != '\t' && *p != ',') {
+                    ++p;
+                }
+                std::string tag(start, static_cast<size_t>(p - start));
+                if (!tag.empty() && std::find(entry->tags.begin(), entry->tags.end(), tag) == entry->tags.end()) {
+                    entry->tags.push_back(std::move(tag));
+                }
+            }
+            continue;
+        }
+        blob.append(header.first).append(": ").append(header.second).append("\r\n");
+        if (::strcasecmp(header.first.c_str(), "ETag") == 0) {
+            entry->etag = header.second;
+        } else if (::strcasecmp(header.first.c_str(), "Last-Modified") == 0) {
+            entry->last_modified = header.second;
+        }
+    }
+    blob.append("X-Cache: HIT\r\n");
+    if (status != 204) {
+        blob.append("Content-Length: ").append(std::to_string(body_len)).append("\r\n");
+    }
+    blob.append("\r\n");
+    entry->head_len = blob.size();
+    blob.append(body, body_len);
+    entry->status = status;
+    return entry;
+}
+
+static void kislayphp_cache_fill_finish(php_kislayphp_gateway_t *gateway,
+                                        const struct mg_request_info *info,
+                                        const struct mg_response_info *resp_info,
+                                        kislayphp_cache_fill &fill) {
+    std::vector<std::pair<std::string, std::string>> headers;
+    for (int i = 0; i < resp_info->num_headers; ++i) {
+        const char *name = resp_info->http_headers[i].name;
+        const char *value = resp_info->http_headers[i].value;
+        if (name != nullptr && value != nullptr) {
+            headers.emplace_back(name, value);
+        }
+    }
+    auto entry = kislayphp_cache_build(resp_info->status_code, resp_info->status_text != nullptr ? resp_info->status_text : "OK",
+                                       headers, fill.body.data(), fill.body.size());
+    entry->stored_ns = kislayphp_now_ns();
+    entry->expires_ns = entry->stored_ns + (fill.ttl - fill.age) * 1000000000LL;
+    entry->initial_age = fill.age;
+    entry->vary = std::move(fill.vary);
+    kislayphp_cache_store(*gateway->cache, kislayphp_cache_key(info), std::move(entry));
+}
+
+// Applies a 304 answer to a revalidated entry: headers the 304 carries
+// replace the stored ones, and the entry is fresh again for the lifetime
+// the 304 gives, or else the lifetime it had. The body is kept as is, and
+// so are the surrogate keys unless the 304 sends new ones.
+static std::shared_ptr<const kislayphp_cache_entry> kislayphp_cache_refresh(php_kislayphp_gateway_t *gateway,
+                                                                          const struct mg_request_info *info,
+                                                                          const kislayphp_cache_entry &stale,
+                                                                          const struct mg_response_info *resp_info) {
+    std::vector<std::pair<std::string, std::string>> headers;
+    kislayphp_cache_each_header(stale, [&headers, resp_info](const std::string &name, const std::string &value,
+                                                              const std::string &) {
+        if (kislayphp_response_header(resp_info, name.c_str()) == nullptr) {
+            headers.emplace_back(name, value);
+        }
+    });
+    for (int i = 0; i < resp_info->num_headers; ++i) {
+        const char *name = resp_info->http_headers[i].name;
+        const char *value = resp_info->http_headers[i].value;
+        if (name != nullptr && value != nullptr) {
+            headers.emplace_back(name, value);
+        }
+    }
+    size_t text_at = stale.blob.find(' ', 9) + 1;
+    std::string status_text(stale.blob, text_at, stale.blob.find("\r\n") - text_at);
+    auto entry = kislayphp_cache_build(stale.status, status_text, headers, stale.blob.data() + stale.head_len,
+                                       stale.blob.size() - stale.head_len);
+    long long lifetime = kislayphp_cache_lifetime(resp_info);
+    entry->initial_age = kislayphp_response_age(resp_info);
+    entry->stored_ns = kislayphp_now_ns();
+    entry->expires_ns = lifetime >= 0
+        ? entry->stored_ns + (lifetime - entry->initial_age) * 1000000000LL
+        : entry->stored_ns + (stale.expires_ns - stale.stored_ns);
+    entry->vary = stale.vary;
+    if (entry->tags.empty()) {
+        entry->tags = stale.tags;
+    }
+    kislayphp_cache_store(*gateway->cache, kislayphp_cache_key(info), entry);
+    return entry;
+}
+
+// Relays the upstream response whose head has arrived on lease to the
+// client, then returns the connection to the pool when it is reusable.
+// Cacheable responses on caching routes are stored on the way through, and
+// a 304 to the revalidation of stale refreshes it and is answered from it.
+// Caching routes keep surrogate keys to themselves.
+static void kislayphp_relay_response(php_kislayphp_gateway_t *gateway,
+                                     struct mg_connection *conn,
+                                     const struct mg_request_info *info,
+                                     const kislayphp_gateway_route &route,
+                                     const kislayphp_cache_entry *stale,
+                                     kislayphp_upstream_lease &lease,
+                                     int64_t deadline_ns,
+                                     char *buffer,
+                                     size_t buffer_size) {
+    struct mg_connection *target = lease.conn;
+    const struct mg_response_info *resp_info = mg_get_response_info(target);
+    int status_code = resp_info ? resp_info->status_code : 502;
+    bool head_request = info->request_method != nullptr && ::strcasecmp(info->request_method, "HEAD") == 0;
+    bool keep_alive = gateway->pool_max_idle > 0;
+    const char *status_text = (resp_info && resp_info->status_text) ? resp_info->status_text : "Bad Gateway";
+    bool bodyless = kislayphp_response_is_bodyless(resp_info, head_request);
+    bool upstream_chunked = kislayphp_response_is_chunked(resp_info);
+    long long content_length = (resp_info && !upstream_chunked) ? resp_info->content_length : -1;
+
+    if (stale != nullptr && status_code == 304) {
+        auto refreshed = kislayphp_cache_refresh(gateway, info, *stale, resp_info);
+        kislayphp_pool_release(gateway, lease, keep_alive && kislayphp_upstream_keeps_alive(resp_info, true));
+        gateway->cache->revalidated.fetch_add(1, std::memory_order_relaxed);
+        kislayphp_cache_flight_settle(conn);
+        kislayphp_cache_write(conn, info, *refreshed, kislayphp_now_ns());
+        return;
+    }
+
+    // Bodies without a known length are re-chunked for HTTP/1.1 clients so the
+    // client connection stays reusable; HTTP/1.0 clients get close-delimited data.
+    bool client_keep_alive = kislayphp_client_keep_alive(conn);
+    bool rechunk = !bodyless && content_length < 0 && kislayphp_client_is_http11(info);
+    if (!bodyless && content_length < 0 && !rechunk) {
+        client_keep_alive = false;
+    }
+
+    bool caching = route.cache && gateway->cache;
+    mg_printf(conn, "HTTP/1.1 %d %s\r\n", status_code, status_text);
+    if (resp_info) {
+        for (int i = 0; i < resp_info->num_headers; ++i) {
+            const char *name = resp_info->http_headers[i].name;
+            const char *value = resp_info->http_headers[i].value;
+            if (name == nullptr || value == nullptr) {
+                continue;
+            }
+            if (kislayphp_is_hop_header(name) || (caching && kislayphp_is_surrogate_header(name))) {
+                continue;
+            }
+            if (upstream_chunked && ::strcasecmp(name, "Content-Length") == 0) {
+                continue;
+            }
+            mg_printf(conn, "%s: %s\r\n", name, value);
+        }
+    }
+    if (rechunk) {
+        mg_printf(conn, "Transfer-Encoding: chunked\r\n");
+    }
+    kislayphp_cache_fill fill;
+    if (caching) {
+        if (kislayphp_cache_fill_start(gateway, conn, info, route, resp_info, fill)) {
+            mg_printf(conn, "X-Cache: MISS\r\n");
+        } else {
+            kislayphp_cache_flight_settle(conn);
+        }
+    }
+    kislayphp_end_response_head(conn, client_keep_alive);
+
+    bool reusable = keep_alive && kislayphp_upstream_keeps_alive(resp_info, bodyless);
+    if (!bodyless) {
+        int read_len = 0;
+        long long relayed = 0;
+        bool client_ok = true;
+        while ((read_len = mg_read(target, buffer, buffer_size)) > 0) {
+            if (rechunk) {
+                client_ok = mg_send_chunk(conn, buffer, static_cast<unsigned int>(read_len)) > 0;
+            } else {
+                client_ok = mg_write(conn, buffer, static_cast<size_t>(read_len)) == read_len;
+            }
+            if (!client_ok) {
+                break;
+            }
+            relayed += read_len;
+            if (fill.active) {
+                if (fill.body.size() + static_cast<size_t>(read_len) > route.cache_max_entry_bytes) {
+                    fill.active = false;
+                    std::string().swap(fill.body);
+                } else {
+                    fill.body.append(buffer, static_cast<size_t>(read_len));
+                }
+            }
+            // Past the deadline the client has given up; stop relaying and
+            // drop both connections instead of holding this worker.
+            if (deadline_ns != 0 && kislayphp_now_ns() >= deadline_ns) {
+                client_ok = false;
+                break;
+            }
+        }
+        bool complete = client_ok && read_len == 0 && (content_length < 0 || relayed == content_length);
+        if (complete && rechunk) {
+            complete = mg_send_chunk(conn, "", 0) > 0;
+        }
+        if (!complete) {
+            reusable = false;
+            fill.active = false;
+            mg_disable_connection_keep_alive(conn);
+        }
+    }
+    if (fill.active) {
+        kislayphp_cache_fill_finish(gateway, info, resp_info, fill);
+        kislayphp_cache_flight_settle(conn);
+    }
+
+    kislayphp_pool_release(gateway, lease, reusable);
+}
+
+enum kislayphp_proxy_result {
+    KISLAYPHP_PROXY_DONE,
+    // Failed before anything reached the client; retry.next is to be tried.
+    KISLAYPHP_PROXY_RETRY,
+};
+
+static kislayphp_proxy_result kislayphp_proxy_request(php_kislayphp_gateway_t *gateway,
+                                                      struct mg_connection *conn,
+                                                      const struct mg_request_info *info,
+                                                      const kislayphp_gateway_route &route,
+                                                      const kislayphp_endpoint &endpoint,
+                                                      const kislayphp_route_match &params,
+                                                      int64_t deadline_ns,
+                                                      kislayphp_retry_state *retry,
+                                                      const kislayphp_cache_entry *stale) {
+    size_t max_body_bytes = gateway->max_body_bytes;
+    if (max_body_bytes > 0 && info->content_length > static_cast<long long>(max_body_bytes)) {
+        kislayphp_send_error(conn, 413, "Payload Too Large", true);
+        return KISLAYPHP_PROXY_DONE;
+    }
+
+    auto remaining_ms = [deadline_ns]() -> long long {
+        if (deadline_ns == 0) {
+            return -1;
+        }
+        return std::max<long long>((deadline_ns - kislayphp_now_ns()) / 1000000, 0);
+    };
+    int first_byte_ms = route.first_byte_timeout_ms > 0 ? route.first_byte_timeout_ms : gateway->first_byte_timeout_ms;
+
+    std::string path = info->local_uri ? info->local_uri : (info->request_uri ? info->request_uri : "/");
+    std::string target_path = kislayphp_join_paths(endpoint.base_path, path);
+    if (info->query_string && *info->query_string) {
+        target_path.append("?");
+        target_path.append(info->query_string);
+    }
+    std::string method = info->request_method ? info->request_method : "GET";
+    bool keep_alive = gateway->pool_max_idle > 0;
+
+    char fallback_buffer[4096];
+    char *buffer = fallback_buffer;
+    size_t buffer_size = sizeof(fallback_buffer);
+    auto *worker = static_cast<kislayphp_worker_state *>(mg_get_thread_pointer(conn));
+    if (worker != nullptr && !worker->relay_buffer.empty()) {
+        buffer = worker->relay_buffer.data();
+        buffer_size = worker->relay_buffer.size();
+    }
+
+    // A pooled connection may have been closed by the upstream while idle; in
+    // that case a bodyless request is replayed once on a fresh connection.
+    // Streamed bodies cannot be replayed, so those fail with 502 instead.
+    kislayphp_upstream *upstream = endpoint.upstream != nullptr
+        ? endpoint.upstream
+        : kislayphp_upstream_for(gateway, endpoint.host, endpoint.port);
+
+    // An open breaker fails fast instead of tying up this worker on a
+    // backend that is known to be struggling.
+    kislayphp_breaker_permit route_permit;
+    kislayphp_breaker_permit upstream_permit;
+    if (route.breaker) {
+        int64_t now_ns = kislayphp_now_ns();
+        if (!route_permit.acquire(route.breaker.get(), route.breaker_config, now_ns)) {
+            kislayphp_send_error(conn, 503, "Circuit breaker open");
+            return KISLAYPHP_PROXY_DONE;
+        }
+        if (!upstream_permit.acquire(&upstream->breaker, route.breaker_config, now_ns)) {
+            if (retry != nullptr && kislayphp_retry_next(*retry, upstream)) {
+                return KISLAYPHP_PROXY_RETRY;
+            }
+            kislayphp_send_error(conn, 503, "Circuit breaker open");
+            return KISLAYPHP_PROXY_DONE;
+        }
+    }
+    auto report = [gateway, upstream, &route_permit, &upstream_permit](bool failed) {
+        kislayphp_record_outcome(gateway, upstream, failed);
+        int64_t now_ns = kislayphp_now_ns();
+        route_permit.record(failed, now_ns);
+        upstream_permit.record(failed, now_ns);
+    };
+    int64_t in_flight_at_start = 0;
+    if (!kislayphp_limit_acquire(gateway, upstream, in_flight_at_start)) {
+        if (retry != nullptr && kislayphp_retry_next(*retry, upstream)) {
+            return KISLAYPHP_PROXY_RETRY;
+        }
+        kislayphp_send_error(conn, 503, "Upstream concurrency limit reached");
+        return KISLAYPHP_PROXY_DONE;
+    }
+    struct in_flight_guard {
+        kislayphp_upstream *upstream;
+        ~in_flight_guard() {
+            kislayphp_limit_release(upstream);
+        }
+    } in_flight{upstream};
+
+    kislayphp_upstream_lease lease;
+    char error_buf[256] = {0};
+    bool allow_reuse = true;
+    bool chunked_body = kislayphp_request_is_chunked(conn, info);
+    bool has_body = info->content_length > 0 || chunked_body;
+    bool continue_sent = false;
+    if (remaining_ms() == 0) {
+        kislayphp_send_error(conn, 504, "Upstream timeout");
+        return KISLAYPHP_PROXY_DONE;
+    }
+    while (true) {
+        if (!kislayphp_pool_acquire(gateway, upstream, allow_reuse, lease)) {
+            int64_t now_ns = kislayphp_now_ns();
+            kislayphp_observe_latency(upstream, KISLAYPHP_EWMA_FAILURE_NS, now_ns);
+            kislayphp_limit_update(gateway, upstream, 0, true, in_flight_at_start, now_ns);
+            report(true);
+            if (retry != nullptr && kislayphp_retry_next(*retry, upstream)) {
+                return KISLAYPHP_PROXY_RETRY;
+            }
+            kislayphp_send_error(conn, 502, "Upstream connect failed");
+            return KISLAYPHP_PROXY_DONE;
+        }
+        long long left_ms = remaining_ms();
+        if (left_ms == 0) {
+            // Connecting (civetweb's connect timeout is fixed) used up the budget.
+            kislayphp_pool_release(gateway, lease, false);
+            report(true);
+            kislayphp_send_error(conn, 504, "Upstream timeout");
+            return KISLAYPHP_PROXY_DONE;
+        }
+        std::string head = kislayphp_format_upstream_request(info, route, endpoint, params, method, target_path,
+                                                             keep_alive, chunked_body, left_ms, stale);
+        mg_write(lease.conn, head.data(), head.size());
+        if (has_body) {
+            kislayphp_send_continue(conn, info, continue_sent);
+            kislayphp_body_result sent = chunked_body
+                ? kislayphp_stream_chunked_body(conn, lease.conn, max_body_bytes, buffer, buffer_size)
+                : kislayphp_stream_request_body(conn, lease.conn, info->content_length, buffer, buffer_size);
+            if (sent != KISLAYPHP_BODY_OK) {
+                kislayphp_pool_release(gateway, lease, false);
+                if (sent == KISLAYPHP_BODY_TOO_LARGE) {
+                    kislayphp_send_error(conn, 413, "Payload Too Large", true);
+                } else if (sent == KISLAYPHP_BODY_CLIENT_ERROR) {
+                    kislayphp_send_error(conn, 400, "Incomplete request body", true);
+                } else {
+                    kislayphp_send_error(conn, 502, "Upstream write failed", true);
+                }
+                return KISLAYPHP_PROXY_DONE;
+            }
+        }
+        int wait_ms = first_byte_ms;
+        left_ms = remaining_ms();
+        if (left_ms >= 0 && left_ms < wait_ms) {
+            wait_ms = static_cast<int>(std::max<long long>(left_ms, 1));
+        }
+        int64_t sent_ns = kislayphp_now_ns();
+        int got = mg_get_response(lease.conn, error_buf, sizeof(error_buf), wait_ms);
+        int64_t now_ns = kislayphp_now_ns();
+        if (got >= 0) {
+            kislayphp_observe_latency(upstream, now_ns - sent_ns, now_ns);
+            kislayphp_limit_update(gateway, upstream, now_ns - sent_ns, false, in_flight_at_start, now_ns);
+            break;
+        }
+        bool timed_out = now_ns - sent_ns >= static_cast<int64_t>(wait_ms) * 1000000;
+        bool replay = lease.reused && !has_body && !timed_out;
+        kislayphp_pool_release(gateway, lease, false);
+        if (!replay) {
+            // A backend that fails fast must not look fast to the balancer.
+            kislayphp_observe_latency(upstream, std::max<int64_t>(now_ns - sent_ns, KISLAYPHP_EWMA_FAILURE_NS), now_ns);
+            kislayphp_limit_update(gateway, upstream, now_ns - sent_ns, true, in_flight_at_start, now_ns);
+            report(true);
+            if (timed_out) {
+                // The upstream may still be working on it, so no retry.
+                kislayphp_send_error(conn, 504, "Upstream timeout");
+            } else if (retry != nullptr && kislayphp_retry_next(*retry, upstream)) {
+                return KISLAYPHP_PROXY_RETRY;
+            } else {
+                kislayphp_send_error(conn, 502, "Upstream response failed");
+            }
+            return KISLAYPHP_PROXY_DONE;
+        }
+        allow_reuse = false;
+    }
+
+    const struct mg_response_info *resp_info = mg_get_response_info(lease.conn);
+    int status_code = resp_info ? resp_info->status_code : 502;
+    report(status_code >= 500);
+    if ((status_code == 502 || status_code == 503 || status_code == 504) &&
+        retry != nullptr && kislayphp_retry_next(*retry, upstream)) {
+        kislayphp_pool_release(gateway, lease, false);
+        return KISLAYPHP_PROXY_RETRY;
+    }
+    kislayphp_relay_response(gateway, conn, info, route, stale, lease, deadline_ns, buffer, buffer_size);
+    return KISLAYPHP_PROXY_DONE;
+}
+
+enum kislayphp_hedge_state {
+    KISLAYPHP_HEDGE_WAITING,
+    KISLAYPHP_HEDGE_HEAD,
+    KISLAYPHP_HEDGE_FAILED,
+};
+
+// One upstream exchange of a hedged request. Its thread connects, sends the
+// prepared request head and waits for the response head, so the worker can
+// watch several exchanges at once.
+struct kislayphp_hedge_attempt {
+    kislayphp_upstream *upstream = nullptr;
+    kislayphp_upstream_lease lease{};
+    kislayphp_breaker_permit permit;
+    std::string request;
+    int wait_ms = 0;
+    int64_t in_flight = 0;
+    int state = KISLAYPHP_HEDGE_WAITING;
+    int status = 0;
+    int error_status = 502;
+    const char *error = "Upstream connect failed";
+};
+
+// Shared by the worker and the attempt threads; a thread that finishes after
+// the worker has decided closes its own connection.
+struct kislayphp_hedge_race {
+    std::mutex lock;
+    std::condition_variable cv;
+    kislayphp_hedge_attempt attempts[KISLAYPHP_HEDGE_ATTEMPTS];
+    std::shared_ptr<kislayphp_latency_histogram> latency;
+    bool decided = false;
+};
+
+static void kislayphp_hedge_run(php_kislayphp_gateway_t *gateway, std::shared_ptr<kislayphp_hedge_race> race, size_t index) {
+    kislayphp_hedge_attempt &attempt = race->attempts[index];
+    kislayphp_upstream *upstream = attempt.upstream;
+    char error_buf[256] = {0};
+    bool allow_reuse = true;
+    bool connected = false;
+    bool timed_out = false;
+    int got = -1;
+    int64_t sent_ns = 0;
+    int64_t now_ns = 0;
+    // As in kislayphp_proxy_request, a pooled connection the upstream closed
+    // while idle is replaced by a fresh one.
+    while (kislayphp_pool_acquire(gateway, upstream, allow_reuse, attempt.lease)) {
+        connected = true;
+        mg_write(attempt.lease.conn, attempt.request.data(), attempt.request.size());
+        sent_ns = kislayphp_now_ns();
+        got = mg_get_response(attempt.lease.conn, error_buf, sizeof(error_buf), attempt.wait_ms);
+        now_ns = kislayphp_now_ns();
+        if (got >= 0) {
+            break;
+        }
+        timed_out = now_ns - sent_ns >= static_cast<int64_t>(attempt.wait_ms) * 1000000;
+        bool replay = attempt.lease.reused && !timed_out;
+        kislayphp_pool_release(gateway, attempt.lease, false);
+        if (!replay) {
+            break;
+        }
+        allow_reuse = false;
+    }
+
+    int status = 0;
+    if (got >= 0) {
+        const struct mg_response_info *resp_info = mg_get_response_info(attempt.lease.conn);
+        status = resp_info ? resp_info->status_code : 502;
+        kislayphp_observe_latency(upstream, now_ns - sent_ns, now_ns);
+        kislayphp_limit_update(gateway, upstream, now_ns - sent_ns, false, attempt.in_flight, now_ns);
+        kislayphp_latency_record(*race->latency, now_ns - sent_ns);
+    } else {
+        now_ns = kislayphp_now_ns();
+        int64_t spent = connected ? now_ns - sent_ns : 0;
+        kislayphp_observe_latency(upstream, std::max<int64_t>(spent, KISLAYPHP_EWMA_FAILURE_NS), now_ns);
+        kislayphp_limit_update(gateway, upstream, spent, true, attempt.in_flight, now_ns);
+    }
+    bool failed = got < 0 || status >= 500;
+    kislayphp_record_outcome(gateway, upstream, failed);
+    attempt.permit.record(failed, now_ns);
+    kislayphp_limit_release(upstream);
+
+    bool discard = false;
+    {
+        std::lock_guard<std::mutex> guard(race->lock);
+        if (got >= 0) {
+            attempt.state = KISLAYPHP_HEDGE_HEAD;
+            attempt.status = status;
+            discard = race->decided;
+        } else {
+            attempt.state = KISLAYPHP_HEDGE_FAILED;
+            if (timed_out) {
+                attempt.error_status = 504;
+                attempt.error = "Upstream timeout";
+            } else if (connected) {
+                attempt.error = "Upstream response failed";
+            }
+        }
+        race->cv.notify_all();
+    }
+    if (discard) {
+        kislayphp_pool_release(gateway, attempt.lease, false);
+    }
+}
+
+static void kislayphp_hedge_worker(php_kislayphp_gateway_t *gateway) {
+    std::unique_lock<std::mutex> guard(gateway->hedge_lock);
+    while (true) {
+        gateway->hedge_work_cv.wait(guard, [gateway]() {
+            return gateway->hedge_stopping || !gateway->hedge_queue.empty();
+        });
+        if (gateway->hedge_queue.empty()) {
+            return;
+        }
+        auto task = std::move(gateway->hedge_queue.front());
+        gateway->hedge_queue.pop_front();
+        guard.unlock();
+        kislayphp_hedge_run(gateway, task.first, task.second);
+        task.first.reset();
+        guard.lock();
+        if (--gateway->hedge_active == 0) {
+            gateway->hedge_cv.notify_all();
+        }
+    }
+}
+
+// Reserves a pool thread for one attempt, starting a thread if all are
+// busy. Fails once hedge_threads_max attempts are in flight.
+static bool kislayphp_hedge_reserve(php_kislayphp_gateway_t *gateway) {
+    std::lock_guard<std::mutex> guard(gateway->hedge_lock);
+    if (gateway->hedge_active >= gateway->hedge_threads_max) {
+        return false;
+    }
+    if (gateway->hedge_pool.size() <= gateway->hedge_active) {
+        try {
+            gateway->hedge_pool.emplace_back(kislayphp_hedge_worker, gateway);
+        } catch (const std::system_error &) {
+            return false;
+        }
+    }
+    ++gateway->hedge_active;
+    return true;
+}
+
+static void kislayphp_hedge_submit(php_kislayphp_gateway_t *gateway, std::shared_ptr<kislayphp_hedge_race> race, size_t index) {
+    {
+        std::lock_guard<std::mutex> guard(gateway->hedge_lock);
+        gateway->hedge_queue.emplace_back(std::move(race), index);
+    }
+    gateway->hedge_work_cv.notify_one();
+}
+
+// Milliseconds a hedged request waits before trying a second upstream.
+static int kislayphp_hedge_delay_ms(const kislayphp_gateway_route &route) {
+    uint64_t us = kislayphp_latency_percentile(*route.latency, route.hedge_percentile);
+    if (us == 0) {
+        return route.hedge_delay_ms;
+    }
+    return static_cast<int>(std::min<uint64_t>((us + 999) / 1000, INT_MAX));
+}
+
+// Proxies a GET or HEAD request on a hedged route. If the first upstream has
+// not answered within the route's hedge delay, or failed, the same request
+// goes to a second one (paid for from the retry budget) and whichever
+// answers first without a 502/503/504 is relayed. The slower exchange is
+// closed as soon as its thread gets its answer or times out. When the hedge
+// pool is saturated the first exchange runs on the worker and the request
+// is not hedged.
+static void kislayphp_proxy_hedged(php_kislayphp_gateway_t *gateway,
+                                   struct mg_connection *conn,
+                                   const struct mg_request_info *info,
+                                   const kislayphp_gateway_route &route,
+                                   kislayphp_target_set &set,
+                                   const kislayphp_route_match &params,
+                                   int64_t deadline_ns,
+                                   const kislayphp_cache_entry *stale) {
+    kislayphp_breaker_permit route_permit;
+    if (route.breaker && !route_permit.acquire(route.breaker.get(), route.breaker_config, kislayphp_now_ns())) {
+        kislayphp_send_error(conn, 503, "Circuit breaker open");
+        return;
+    }
+
+    int first_byte_ms = route.first_byte_timeout_ms > 0 ? route.first_byte_timeout_ms : gateway->first_byte_timeout_ms;
+    std::string path = info->local_uri ? info->local_uri : (info->request_uri ? info->request_uri : "/");
+    std::string method = info->request_method ? info->request_method : "GET";
+    bool keep_alive = gateway->pool_max_idle > 0;
+
+    auto race = std::make_shared<kislayphp_hedge_race>();
+    race->latency = route.latency;
+    const kislayphp_upstream *tried[KISLAYPHP_HEDGE_ATTEMPTS];
+    size_t launched = 0;
+    // Prepares and starts the next attempt; one that cannot start is marked
+    // failed right away. Without a free pool thread the attempt runs on the
+    // worker if nothing else is pending, and is not started otherwise.
+    auto launch = [&](const kislayphp_endpoint &endpoint, bool may_run_inline) {
+        bool pooled = kislayphp_hedge_reserve(gateway);
+        if (!pooled && !may_run_inline) {
+            return false;
+        }
+        kislayphp_hedge_attempt &attempt = race->attempts[launched];
+        attempt.upstream = endpoint.upstream != nullptr
+            ? endpoint.upstream
+            : kislayphp_upstream_for(gateway, endpoint.host, endpoint.port);
+        tried[launched++] = attempt.upstream;
+        // Gives back the pool reservation of an attempt that never starts.
+        auto unreserve = [&]() {
+            if (!pooled) {
+                return;
+            }
+            std::lock_guard<std::mutex> guard(gateway->hedge_lock);
+            if (--gateway->hedge_active == 0) {
+                gateway->hedge_cv.notify_all();
+            }
+        };
+        if (route.breaker && !attempt.permit.acquire(&attempt.upstream->breaker, route.breaker_config, kislayphp_now_ns())) {
+            attempt.error_status = 503;
+            attempt.error = "Circuit breaker open";
+            attempt.state = KISLAYPHP_HEDGE_FAILED;
+            unreserve();
+            return true;
+        }
+        long long left_ms = deadline_ns == 0 ? -1 : std::max<long long>((deadline_ns - kislayphp_now_ns()) / 1000000, 0);
+        if (left_ms == 0) {
+            attempt.error_status = 504;
+            attempt.error = "Upstream timeout";
+            attempt.state = KISLAYPHP_HEDGE_FAILED;
+            unreserve();
+            return true;
+        }
+        attempt.wait_ms = left_ms > 0 && left_ms < first_byte_ms ? static_cast<int>(left_ms) : first_byte_ms;
+        std::string target_path = kislayphp_join_paths(endpoint.base_path, path);
+        if (info->query_string && *info->query_string) {
+            target_path.append("?");
+            target_path.append(info->query_string);
+        }
+        if (!kislayphp_limit_acquire(gateway, attempt.upstream, attempt.in_flight)) {
+            attempt.error_status = 503;
+            attempt.error = "Upstream concurrency limit reached";
+            attempt.state = KISLAYPHP_HEDGE_FAILED;
+            unreserve();
+            return true;
+        }
+        attempt.request = kislayphp_format_upstream_request(info, route, endpoint, params, method, target_path,
+                                                            keep_alive, false, left_ms, stale);
+        if (pooled) {
+            kislayphp_hedge_submit(gateway, race, launched - 1);
+        } else {
+            kislayphp_hedge_run(gateway, race, launched - 1);
+        }
+        return true;
+    };
+
+    launch(kislayphp_pick_endpoint(set, conn, info, params), true);
+    auto hedge_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(kislayphp_hedge_delay_ms(route));
+    bool can_hedge = true;
+    int winner = -1;
+    std::unique_lock<std::mutex> guard(race->lock);
+    while (true) {
+        int fallback = -1;
+        bool pending = false;
+        for (size_t i = 0; i < launched; ++i) {
+            const kislayphp_hedge_attempt &attempt = race->attempts[i];
+            if (attempt.state == KISLAYPHP_HEDGE_WAITING) {
+                pending = true;
+            } else if (attempt.state == KISLAYPHP_HEDGE_HEAD) {
+                if (attempt.status != 502 && attempt.status != 503 && attempt.status != 504) {
+                    winner = static_cast<int>(i);
+                    break;
+                }
+                if (fallback < 0) {
+                    fallback = static_cast<int>(i);
+                }
+            }
+        }
+        if (winner >= 0) {
+            break;
+        }
+        can_hedge = can_hedge && launched < KISLAYPHP_HEDGE_ATTEMPTS;
+        if (!pending && !can_hedge) {
+            winner = fallback;
+            break;
+        }
+        if (can_hedge && (!pending || std::chrono::steady_clock::now() >= hedge_at)) {
+            guard.unlock();
+            const kislayphp_endpoint &next = kislayphp_pick_endpoint(set, conn, info, params, tried, launched);
+            if (std::find(tried, tried + launched, next.upstream) != tried + launched ||
+                !kislayphp_retry_withdraw(gateway)) {
+                can_hedge = false;
+            } else if (!launch(next, !pending)) {
+                kislayphp_retry_deposit(gateway, 1000);
+                can_hedge = false;
+            } else {
+                gateway->hedges.fetch_add(1, std::memory_order_relaxed);
+            }
+            guard.lock();
+            continue;
+        }
+        if (can_hedge) {
+            race->cv.wait_until(guard, hedge_at);
+        } else {
+            race->cv.wait(guard);
+        }
+    }
+    race->decided = true;
+    kislayphp_upstream_lease lease{};
+    std::vector<kislayphp_upstream_lease> losers;
+    for (size_t i = 0; i < launched; ++i) {
+        kislayphp_hedge_attempt &attempt = race->attempts[i];
+        if (attempt.state != KISLAYPHP_HEDGE_HEAD) {
+            continue;
+        }
+        if (static_cast<int>(i) == winner) {
+            lease = attempt.lease;
+        } else {
+            losers.push_back(attempt.lease);
+        }
+        attempt.lease.conn = nullptr;
+    }
+    const kislayphp_hedge_attempt &last = race->attempts[launched - 1];
+    int error_status = last.error_status;
+    const char *error = last.error;
+    guard.unlock();
+    for (auto &loser : losers) {
+        kislayphp_pool_release(gateway, loser, false);
+    }
+
+    if (winner < 0) {
+        route_permit.record(true, kislayphp_now_ns());
+        kislayphp_send_error(conn, error_status, error);
+        return;
+    }
+    if (winner > 0) {
+        gateway->hedge_wins.fetch_add(1, std::memory_order_relaxed);
+    }
+    const struct mg_response_info *resp_info = mg_get_response_info(lease.conn);
+    route_permit.record(resp_info == nullptr || resp_info->status_code >= 500, kislayphp_now_ns());
+
+    char fallback_buffer[4096];
+    char *buffer = fallback_buffer;
+    size_t buffer_size = sizeof(fallback_buffer);
+    auto *worker = static_cast<kislayphp_worker_state *>(mg_get_thread_pointer(conn));
+    if (worker != nullptr && !worker->relay_buffer.empty()) {
+        buffer = worker->relay_buffer.data();
+        buffer_size = worker->relay_buffer.size();
+    }
+    kislayphp_relay_response(gateway, conn, info, route, stale, lease, deadline_ns, buffer, buffer_size);
+}
+
+// Proxies a request to one of a target set's endpoints. Idempotent requests
+// without a body that fail before anything reached the client (connect
+// failure, reset, or a 502/503/504 answer) are retried on a different
+// endpoint, within the retry budget and the request's deadline. GET and
+// HEAD requests on hedged routes are raced instead.
+static void kislayphp_proxy_to_set(php_kislayphp_gateway_t *gateway,
+                                   struct mg_connection *conn,
+                                   const struct mg_request_info *info,
+                                   const kislayphp_gateway_route &route,
+                                   kislayphp_target_set &set,
+                                   const kislayphp_route_match &params,
+                                   const kislayphp_cache_entry *stale) {
+    int64_t deadline_ns = kislayphp_request_deadline(gateway, conn, route);
+    int retries = route.retries >= 0 ? route.retries : gateway->retries;
+    bool has_body = info->content_length > 0 || kislayphp_request_is_chunked(conn, info);
+    kislayphp_method method = kislayphp_method_from(info->request_method != nullptr ? info->request_method : "GET");
+    kislayphp_retry_deposit(gateway, static_cast<int64_t>(gateway->retry_budget_percent) * 10);
+    if (route.latency && !has_body && set.endpoints.size() >= 2 &&
+        (method == KISLAYPHP_METHOD_GET || method == KISLAYPHP_METHOD_HEAD)) {
+        kislayphp_proxy_hedged(gateway, conn, info, route, set, params, deadline_ns, stale);
+        return;
+    }
+
+    const kislayphp_endpoint *endpoint = &kislayphp_pick_endpoint(set, conn, info, params);
+    if (retries <= 0 || set.endpoints.size() < 2 || has_body || !kislayphp_method_is_idempotent(method)) {
+        kislayphp_proxy_request(gateway, conn, info, route, *endpoint, params, deadline_ns, nullptr, stale);
+        return;
+    }
+    kislayphp_retry_state retry;
+    retry.gateway = gateway;
+    retry.set = &set;
+    retry.conn = conn;
+    retry.info = info;
+    retry.params = &params;
+    retry.tried_count = 0;
+    retry.retries_left = retries;
+    retry.next = nullptr;
+    while (kislayphp_proxy_request(gateway, conn, info, route, *endpoint, params, deadline_ns, &retry, stale) ==
+           KISLAYPHP_PROXY_RETRY) {
+        endpoint = retry.next;
+    }
+}
+
+static void *kislayphp_gateway_init_thread(const struct mg_context *ctx, int thread_type) {
+    if (thread_type != 1) {
+        return nullptr;
+    }
+    auto *gateway = static_cast<php_kislayphp_gateway_t *>(mg_get_user_data(ctx));
+    auto *worker = new kislayphp_worker_state();
+    worker->relay_buffer.resize(gateway != nullptr ? gateway->relay_buffer_bytes : 16384);
+    return worker;
+}
+
+static void kislayphp_gateway_exit_thread(const struct mg_context *ctx, int thread_type, void *thread_pointer) {
+    (void)ctx;
+    (void)thread_type;
+    delete static_cast<kislayphp_worker_state *>(thread_pointer);
+}
+
+static int kislayphp_gateway_begin_request(struct mg_connection *conn) {
+    const struct mg_request_info *info = mg_get_request_info(conn);
+    if (info == nullptr || info->user_data == nullptr) {
+        return 0;
+    }
+
+    auto *gateway = static_cast<php_kislayphp_gateway_t *>(info->user_data);
+    uintptr_t served = reinterpret_cast<uintptr_t>(mg_get_user_connection_data(conn));
+    mg_set_user_connection_data(conn, reinterpret_cast<void *>(served + 1));
+    const char *path = info->local_uri ? info->local_uri : (info->request_uri ? info->request_uri : "");
+
+    // Held for the whole request: routes and services published meanwhile
+    // do not free what this request is using.
+    std::shared_ptr<const kislayphp_route_table> table = gateway->route_table.load();
+    kislayphp_route_match params;
+    if (!kislayphp_router_match(*table, info->request_method, path, params) && table->has_fallback) {
+        params.route = &table->fallback_route;
+        params.path = path;
+    }
+
+    const kislayphp_gateway_route *match = params.route;
+    if (match == nullptr) {
+        kislayphp_send_error(conn, 404, "Not Found");
+        return 1;
+    }
+    if (!kislayphp_params_are_safe(params)) {
+        kislayphp_send_error(conn, 400, "Bad Request");
+        return 1;
+    }
+    kislayphp_cache_flight_lead flight;
+    std::shared_ptr<const kislayphp_cache_entry> stale;
+    if (match->cache && kislayphp_cache_serve(gateway, conn, info, *match, flight, stale)) {
+        return 1;
+    }
+
+    if (match->use_service) {
+        std::shared_ptr<const kislayphp_registry> registry = gateway->registry.load();
+        auto registered = registry->services.find(match->service);
+        if (registered != registry->services.end() && !registered->second->endpoints.empty()) {
+            kislayphp_proxy_to_set(gateway, conn, info, *match, *registered->second, params, stale.get());
+            return 1;
+        }
+
+        const kislayphp_endpoint *endpoint = nullptr;
+        std::shared_ptr<kislayphp_resolve_job> job;
+        bool refresh = false;
+        int64_t deadline_ns = kislayphp_request_deadline(gateway, conn, *match);
+        auto cached = kislayphp_resolution_lookup(gateway, *match, refresh);
+        if (cached) {
+            endpoint = &cached->endpoint;
+        } else {
+            // A job queued between wait() calls waits no longer than the
+            // upstream would be given to answer.
+            int first_byte_ms = match->first_byte_timeout_ms > 0 ? match->first_byte_timeout_ms : gateway->first_byte_timeout_ms;
+            int64_t wait_until_ns = kislayphp_now_ns() + static_cast<int64_t>(first_byte_ms) * 1000000;
+            if (deadline_ns != 0 && deadline_ns < wait_until_ns) {
+                wait_until_ns = deadline_ns;
+            }
+            job = kislayphp_make_resolve_job(info, *match, params, false);
+            kislayphp_resolve(gateway, job, wait_until_ns);
+            if (job->error != nullptr) {
+                kislayphp_send_error(conn, job->error_status, job->error);
+                return 1;
+            }
+            endpoint = &job->endpoint;
+        }
+        kislayphp_proxy_request(gateway, conn, info, *match, *endpoint, params, deadline_ns, nullptr, stale.get());
+
+        // Stale-while-revalidate: the client has already been served from
+        // the stale entry. The refresh is queued to the executor; a failed
+        // or dropped refresh leaves the stale entry in place.
+        if (refresh) {
+            kislayphp_resolve(gateway, kislayphp_make_resolve_job(info, *match, params, true), 0);
+        }
+        return 1;
+    }
+
+    kislayphp_proxy_to_set(gateway, conn, info, *match, *match->targets, params, stale.get());
+    return 1;
+}
+
+// Before listen() there are no readers, so the live table is extended in
+// place and bulk registration stays linear. Once running, a copy with a
+// freshly built router is published instead.
+static void kislayphp_add_route(php_kislayphp_gateway_t *gateway, const kislayphp_gateway_route &route) {
+    std::lock_guard<std::mutex> guard(gateway->lock);
+    std::shared_ptr<const kislayphp_route_table> current = gateway->route_table.load();
+    if (gateway->ctx == nullptr) {
+        auto *table = const_cast<kislayphp_route_table *>(current.get());
+        table->routes.push_back(route);
+        kislayphp_router_insert(table->router, table->routes, table->routes.size() - 1);
+        return;
+    }
+    auto next = std::make_shared<kislayphp_route_table>();
+    next->routes.reserve(current->routes.size() + 1);
+    next->routes = current->routes;
+    next->routes.push_back(route);
+    next->fallback_route = current->fallback_route;
+    next->has_fallback = current->has_fallback;
+    kislayphp_router_build(*next);
+    gateway->route_table.publish(std::move(next));
+}
+
+static void kislayphp_set_fallback(php_kislayphp_gateway_t *gateway, const kislayphp_gateway_route &route) {
+    std::lock_guard<std::mutex> guard(gateway->lock);
+    std::shared_ptr<const kislayphp_route_table> current = gateway->route_table.load();
+    if (gateway->ctx == nullptr) {
+        auto *table = const_cast<kislayphp_route_table *>(current.get());
+        table->fallback_route = route;
+        table->has_fallback = true;
+        return;
+    }
+    auto next = std::make_shared<kislayphp_route_table>();
+    next->routes = current->routes;
+    next->fallback_route = route;
+    next->has_fallback = true;
+    kislayphp_router_build(*next);
+    gateway->route_table.publish(std::move(next));
+}
+
+static bool kislayphp_parse_targets(php_kislayphp_gateway_t *gateway,
+                                    HashTable *targets,
+                                    std::vector<kislayphp_endpoint> &out,
+                                    std::string &error) {
+    zval *value = nullptr;
+    ZEND_HASH_FOREACH_VAL(targets, value) {
+        kislayphp_endpoint endpoint;
+        if (Z_TYPE_P(value) != IS_STRING ||
+            !kislayphp_parse_target(std::string(Z_STRVAL_P(value), Z_STRLEN_P(value)), endpoint)) {
+            error = "Invalid target (expected http://host:port)";
+            return false;
+        }
+        kislayphp_bind_endpoint(gateway, endpoint);
+        out.push_back(std::move(endpoint));
+    } ZEND_HASH_FOREACH_END();
+    if (out.empty()) {
+        error = "At least one target is required";
+        return false;
+    }
+    return true;
+}
+
+// Publishes a registry in which name maps to service, or is removed when
+// service is null. Services that are not touched keep their state.
+static void kislayphp_update_registry(php_kislayphp_gateway_t *gateway,
+                                      const std::string &name,
+                                      std::shared_ptr<kislayphp_target_set> service) {
+    auto next = std::make_shared<kislayphp_registry>(*gateway->registry.load());
+    if (service) {
+        next->services[name] = std::move(service);
+    } else {
+        next->services.erase(name);
+    }
+    gateway->registry.publish(std::move(next));
+}
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_void, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_add, 0, 0, 3)
+    ZEND_ARG_TYPE_INFO(0, method, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, path, IS_STRING, 0)
+    ZEND_ARG_INFO(0, target)
+    ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_add_service, 0, 0, 3)
+    ZEND_ARG_TYPE_INFO(0, method, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, path, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_listen, 0, 0, 2)
+    ZEND_ARG_TYPE_INFO(0, host, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, port, IS_LONG, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_threads, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, count, IS_LONG, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_connection_pool, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, maxIdle, IS_LONG, 0)
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, maxLifetimeMs, IS_LONG, 0, "60000")
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, idleTimeoutMs, IS_LONG, 0, "2000")
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_keep_alive, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, enabled, _IS_BOOL, 0)
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, timeoutMs, IS_LONG, 0, "5000")
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, maxRequests, IS_LONG, 0, "100")
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_resolver, 0, 0, 1)
+    ZEND_ARG_CALLABLE_INFO(0, resolver, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_resolver_cache, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, ttlMs, IS_LONG, 0)
+    ZEND_ARG_TYPE_INFO(0, staleMs, IS_LONG, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_wait, 0, 0, 0)
+    ZEND_ARG_TYPE_INFO(0, timeoutMs, IS_LONG, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_retry_policy, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, maxRetries, IS_LONG, 0)
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, budgetPercent, IS_LONG, 0, "10")
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, minPerSecond, IS_LONG, 0, "10")
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_timeouts, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, firstByteMs, IS_LONG, 0)
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, totalMs, IS_LONG, 0, "0")
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_outlier_detection, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, consecutiveErrors, IS_LONG, 0)
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, baseEjectionMs, IS_LONG, 0, "30000")
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, maxEjectionMs, IS_LONG, 0, "300000")
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_health_check, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, path, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_response_cache, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, maxBytes, IS_LONG, 0)
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, shards, IS_LONG, 0, "16")
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_cache_file, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, path, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO_WITH_DEFAULT_VALUE(0, maxBytes, IS_LONG, 0, "268435456")
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_purge_tags, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, tags, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_concurrency_limit, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, max, IS_LONG, 0)
+    ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_register_service, 0, 0, 2)
+    ZEND_ARG_TYPE_INFO(0, name, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, targets, IS_ARRAY, 0)
+    ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_deregister_service, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, name, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, targets, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_fallback, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, target, IS_STRING, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_fallback_service, 0, 0, 1)
+    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(KislayPHPGateway, __construct) {
+    ZEND_PARSE_PARAMETERS_NONE();
+}
+
+PHP_METHOD(KislayPHPGateway, addRoute) {
+    char *method = nullptr;
+    size_t method_len = 0;
+    char *path = nullptr;
+    size_t path_len = 0;
+    zval *target = nullptr;
+    HashTable *options = nullptr;
+    ZEND_PARSE_PARAMETERS_START(3, 4)
+        Z_PARAM_STRING(method, method_len)
+        Z_PARAM_STRING(path, path_len)
+        Z_PARAM_ZVAL(target)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_HT(options)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    kislayphp_gateway_route route;
+    route.method.assign(kislayphp_to_upper(std::string(method, method_len)));
+    route.method_id = kislayphp_method_from(route.method.c_str());
+    route.path.assign(path, path_len);
+    route.use_service = false;
+    route.targets = std::make_shared<kislayphp_target_set>();
+    std::string error;
+    bool parsed = false;
+    if (Z_TYPE_P(target) == IS_ARRAY) {
+        parsed = kislayphp_parse_targets(obj, Z_ARRVAL_P(target), route.targets->endpoints, error);
+    } else if (Z_TYPE_P(target) == IS_STRING) {
+        route.targets->endpoints.emplace_back();
+        parsed = kislayphp_parse_target(std::string(Z_STRVAL_P(target), Z_STRLEN_P(target)), route.targets->endpoints[0]);
+        if (parsed) {
+            kislayphp_bind_endpoint(obj, route.targets->endpoints[0]);
+        } else {
+            error = "Invalid target (expected http://host:port)";
+        }
+    } else {
+        error = "Target must be a string or an array of strings";
+    }
+    if (!parsed) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    if (route.path.empty()) {
+        route.path = "/";
+    }
+    if (!kislayphp_compile_pattern(route, error) || !kislayphp_apply_route_options(route, options, error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    kislayphp_build_maglev(*route.targets);
+
+    kislayphp_add_route(obj, route);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPGateway, addServiceRoute) {
+    char *method = nullptr;
+    size_t method_len = 0;
+    char *path = nullptr;
+    size_t path_len = 0;
+    char *service = nullptr;
+    size_t service_len = 0;
+    HashTable *options = nullptr;
+    ZEND_PARSE_PARAMETERS_START(3, 4)
+        Z_PARAM_STRING(method, method_len)
+        Z_PARAM_STRING(path, path_len)
+        Z_PARAM_STRING(service, service_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_HT(options)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    kislayphp_gateway_route route;
+    route.method.assign(kislayphp_to_upper(std::string(method, method_len)));
+    route.method_id = kislayphp_method_from(route.method.c_str());
+    route.path.assign(path, path_len);
+    route.service.assign(service, service_len);
+    route.use_service = true;
+    route.resolution = std::make_shared<kislayphp_resolution_slot>();
+    if (route.path.empty()) {
+        route.path = "/";
+    }
+    std::string error;
+    if (!kislayphp_compile_pattern(route, error) || !kislayphp_apply_route_options(route, options, error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+
+    kislayphp_add_route(obj, route);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPGateway, routes) {
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    array_init(return_value);
+    std::shared_ptr<const kislayphp_route_table> table = obj->route_table.load();
+    for (const auto &route : table->routes) {
+        zval entry;
+        array_init(&entry);
+        add_assoc_string(&entry, "method", route.method.c_str());
+        add_assoc_string(&entry, "path", route.path.c_str());
+        if (route.use_service) {
+            add_assoc_string(&entry, "service", route.service.c_str());
+        } else if (route.targets->endpoints.size() == 1) {
+            add_assoc_string(&entry, "target", route.targets->endpoints[0].target.c_str());
+        } else {
+            zval targets;
+            array_init(&targets);
+            for (const auto &endpoint : route.targets->endpoints) {
+                add_next_index_string(&targets, endpoint.target.c_str());
+            }
+            add_assoc_zval(&entry, "targets", &targets);
+            add_assoc_string(&entry, "balancer", kislayphp_balancer_name(route.targets->balancing.balancer));
+            if (route.targets->balancing.balancer == KISLAYPHP_BALANCE_MAGLEV) {
+                add_assoc_string(&entry, "hash_key", route.targets->balancing.hash_key.spec.c_str());
+            }
+        }
+        if (route.breaker) {
+            add_assoc_string(&entry, "circuit", kislayphp_breaker_state_name(*route.breaker));
+        }
+        if (route.latency) {
+            add_assoc_long(&entry, "hedge_delay_ms", kislayphp_hedge_delay_ms(route));
+        }
+        if (route.cache) {
+            add_assoc_long(&entry, "cache_ttl", route.cache_ttl);
+        }
+        add_next_index_zval(return_value, &entry);
+    }
+}
+
+PHP_METHOD(KislayPHPGateway, setThreads) {
+    zend_long count = 1;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_LONG(count)
+    ZEND_PARSE_PARAMETERS_END();
+
+    if (count < 1) {
+        zend_throw_exception(zend_ce_exception, "Thread count must be >= 1", 0);
+        RETURN_FALSE;
+    }
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
+
+    obj->thread_count = static_cast<int>(count);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPGateway, setConnectionPool) {
+    zend_long max_idle = 0;
+    zend_long max_lifetime_ms = 60000;
+    zend_long idle_timeout_ms = 2000;
+    ZEND_PARSE_PARAMETERS_START(1, 3)
+        Z_PARAM_LONG(max_idle)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(max_lifetime_ms)
+        Z_PARAM_LONG(idle_timeout_ms)
+    ZEND_PARSE_PARAMETERS_END();
+
+    if (max_idle < 0) {
+        zend_throw_exception(zend_ce_exception, "Max idle connections must be >= 0", 0);
+        RETURN_FALSE;
+    }
+    if (max_lifetime_ms < 1 || idle_timeout_ms < 1) {
+        zend_throw_exception(zend_ce_exception, "Pool timeouts must be >= 1 ms", 0);
+        RETURN_FALSE;
+    }
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
+
+    obj->pool_max_idle = static_cast<size_t>(max_idle);
+    obj->pool_max_lifetime_ms = static_cast<int>(max_lifetime_ms);
+    obj->pool_idle_timeout_ms = static_cast<int>(idle_timeout_ms);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPGateway, setKeepAlive) {
+    bool enabled = true;
+    zend_long timeout_ms = 5000;
+    zend_long max_requests = 100;
+    ZEND_PARSE_PARAMETERS_START(1, 3)
+        Z_PARAM_BOOL(enabled)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(timeout_ms)
+        Z_PARAM_LONG(max_requests)
+    ZEND_PARSE_PARAMETERS_END();
+
+    if (timeout_ms < 1) {
+        zend_throw_exception(zend_ce_exception, "Keep-alive timeout must be >= 1 ms", 0);
+        RETURN_FALSE;
+    }
+    if (max_requests < 0) {
+        zend_throw_exception(zend_ce_exception, "Max requests per connection must be >= 0", 0);
+        RETURN_FALSE;
+    }
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
+
+    obj->keep_alive = enabled;
+    obj->keep_alive_timeout_ms = static_cast<int>(timeout_ms);
+    obj->keep_alive_max_requests = static_cast<size_t>(max_requests);
+    RETURN_TRUE;
+}
+
+// Retries of failed idempotent requests on another endpoint: at most
+// maxRetries per request (routes may override with 'retries'), and overall
+// at most budgetPercent of request volume plus minPerSecond.
+PHP_METHOD(KislayPHPGateway, setRetryPolicy) {
+    zend_long max_retries = 1;
+    zend_long budget_percent = 10;
+    zend_long min_per_second = 10;
+    ZEND_PARSE_PARAMETERS_START(1, 3)
+        Z_PARAM_LONG(max_retries)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(budget_percent)
+        Z_PARAM_LONG(min_per_second)
+    ZEND_PARSE_PARAMETERS_END();
+
+    if (max_retries < 0 || max_retries > KISLAYPHP_MAX_RETRIES) {
+        std::string error = "Max retries must be between 0 and " + std::to_string(KISLAYPHP_MAX_RETRIES);
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    if (budget_percent < 0 || budget_percent > 100) {
+        zend_throw_exception(zend_ce_exception, "Retry budget must be between 0 and 100 percent", 0);
+        RETURN_FALSE;
+    }
+    if (min_per_second < 0 || min_per_second > KISLAYPHP_RETRY_TOKEN_CAP) {
+        std::string error = "Minimum retries per second must be between 0 and " + std::to_string(KISLAYPHP_RETRY_TOKEN_CAP);
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
     }
 
-    kislayphp_proxy_request(conn, info, match, gateway->max_body_bytes);
-    return 1;
+    obj->retries = static_cast<int>(max_retries);
+    obj->retry_budget_percent = static_cast<int>(budget_percent);
+    obj->retry_min_per_sec = static_cast<int>(min_per_second);
+    obj->retry_tokens.store(static_cast<int64_t>(min_per_second) * 1000, std::memory_order_relaxed);
+    obj->retry_refilled.store(kislayphp_now_ns(), std::memory_order_relaxed);
+    RETURN_TRUE;
 }
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_void, 0, 0, 0)
-ZEND_END_ARG_INFO()
-
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_add, 0, 0, 3)
-    ZEND_ARG_TYPE_INFO(0, method, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, path, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, target, IS_STRING, 0)
-ZEND_END_ARG_INFO()
+// Default upstream timeouts for routes that do not set their own: how long
+// to wait for the response head, and the whole-request budget (0 for none)
+// that is also forwarded upstream as X-Request-Deadline.
+PHP_METHOD(KislayPHPGateway, setTimeouts) {
+    zend_long first_byte_ms = 10000;
+    zend_long total_ms = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_LONG(first_byte_ms)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(total_ms)
+    ZEND_PARSE_PARAMETERS_END();
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_add_service, 0, 0, 3)
-    ZEND_ARG_TYPE_INFO(0, method, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, path, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
-ZEND_END_ARG_INFO()
+    if (first_byte_ms < 1 || first_byte_ms > INT_MAX) {
+        zend_throw_exception(zend_ce_exception, "First byte timeout must be >= 1 ms", 0);
+        RETURN_FALSE;
+    }
+    if (total_ms < 0 || total_ms > INT_MAX) {
+        zend_throw_exception(zend_ce_exception, "Total timeout must be >= 0 ms", 0);
+        RETURN_FALSE;
+    }
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_listen, 0, 0, 2)
-    ZEND_ARG_TYPE_INFO(0, host, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, port, IS_LONG, 0)
-ZEND_END_ARG_INFO()
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_threads, 0, 0, 1)
-    ZEND_ARG_TYPE_INFO(0, count, IS_LONG, 0)
-ZEND_END_ARG_INFO()
+    obj->first_byte_timeout_ms = static_cast<int>(first_byte_ms);
+    obj->total_timeout_ms = static_cast<int>(total_ms);
+    RETURN_TRUE;
+}
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_resolver, 0, 0, 1)
-    ZEND_ARG_CALLABLE_INFO(0, resolver, 0)
-ZEND_END_ARG_INFO()
+// Configures passive outlier detection: an upstream that returns
+// consecutiveErrors 5xx responses or transport failures in a row is taken
+// out of balancing, for twice as long on each repeat. 0 disables it, which
+// is the default.
+PHP_METHOD(KislayPHPGateway, setOutlierDetection) {
+    zend_long consecutive_errors = 5;
+    zend_long base_ms = 30000;
+    zend_long max_ms = 300000;
+    ZEND_PARSE_PARAMETERS_START(1, 3)
+        Z_PARAM_LONG(consecutive_errors)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(base_ms)
+        Z_PARAM_LONG(max_ms)
+    ZEND_PARSE_PARAMETERS_END();
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_fallback, 0, 0, 1)
-    ZEND_ARG_TYPE_INFO(0, target, IS_STRING, 0)
-ZEND_END_ARG_INFO()
+    if (consecutive_errors < 0) {
+        zend_throw_exception(zend_ce_exception, "Consecutive errors must be >= 0", 0);
+        RETURN_FALSE;
+    }
+    if (base_ms < 1 || max_ms < base_ms) {
+        zend_throw_exception(zend_ce_exception, "Ejection times must be >= 1 ms and max must be >= base", 0);
+        RETURN_FALSE;
+    }
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_gateway_set_fallback_service, 0, 0, 1)
-    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
-ZEND_END_ARG_INFO()
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
 
-PHP_METHOD(KislayPHPGateway, __construct) {
-    ZEND_PARSE_PARAMETERS_NONE();
+    obj->outlier_errors = static_cast<uint32_t>(consecutive_errors);
+    obj->outlier_base_ms = static_cast<int>(base_ms);
+    obj->outlier_max_ms = static_cast<int>(max_ms);
+    RETURN_TRUE;
 }
 
-PHP_METHOD(KislayPHPGateway, addRoute) {
-    char *method = nullptr;
-    size_t method_len = 0;
-    char *path = nullptr;
-    size_t path_len = 0;
-    char *target = nullptr;
-    size_t target_len = 0;
-    ZEND_PARSE_PARAMETERS_START(3, 3)
-        Z_PARAM_STRING(method, method_len)
-        Z_PARAM_STRING(path, path_len)
-        Z_PARAM_STRING(target, target_len)
+// Sizes the in-memory response cache used by routes with the 'cache'
+// option: max_bytes over all entries (0 disables caching), split over
+// shards LRU lists with a lock each. A configured cache file is kept.
+PHP_METHOD(KislayPHPGateway, setResponseCache) {
+    zend_long max_bytes = 0;
+    zend_long shards = 16;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_LONG(max_bytes)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(shards)
     ZEND_PARSE_PARAMETERS_END();
 
+    if (max_bytes < 0) {
+        zend_throw_exception(zend_ce_exception, "Cache size must be >= 0", 0);
+        RETURN_FALSE;
+    }
+    if (shards < 1 || shards > 1024) {
+        zend_throw_exception(zend_ce_exception, "Cache shards must be between 1 and 1024", 0);
+        RETURN_FALSE;
+    }
     php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
-    kislayphp_gateway_route route;
-    route.method.assign(kislayphp_to_upper(std::string(method, method_len)));
-    route.path.assign(path, path_len);
-    route.target.assign(target, target_len);
-    route.use_service = false;
-    if (!kislayphp_parse_target(route.target, route)) {
-        zend_throw_exception(zend_ce_exception, "Invalid target (expected http://host:port)", 0);
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
         RETURN_FALSE;
     }
-    if (route.path.empty()) {
-        route.path = "/";
+    std::unique_ptr<kislayphp_disk_tier> disk = obj->cache ? std::move(obj->cache->disk) : nullptr;
+    obj->cache = kislayphp_cache_create(static_cast<size_t>(max_bytes), static_cast<size_t>(shards));
+    if (obj->cache) {
+        obj->cache->disk = std::move(disk);
     }
-
-    std::lock_guard<std::mutex> guard(obj->lock);
-    obj->routes.push_back(route);
     RETURN_TRUE;
 }
 
-PHP_METHOD(KislayPHPGateway, addServiceRoute) {
-    char *method = nullptr;
-    size_t method_len = 0;
+PHP_METHOD(KislayPHPGateway, setCacheFile) {
     char *path = nullptr;
     size_t path_len = 0;
-    char *service = nullptr;
-    size_t service_len = 0;
-    ZEND_PARSE_PARAMETERS_START(3, 3)
-        Z_PARAM_STRING(method, method_len)
+    zend_long max_bytes = 256 << 20;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
         Z_PARAM_STRING(path, path_len)
-        Z_PARAM_STRING(service, service_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(max_bytes)
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
-    kislayphp_gateway_route route;
-    route.method.assign(kislayphp_to_upper(std::string(method, method_len)));
-    route.path.assign(path, path_len);
-    route.target.clear();
-    route.service.assign(service, service_len);
-    route.use_service = true;
-    if (route.path.empty()) {
-        route.path = "/";
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
+    if (!obj->cache) {
+        zend_throw_exception(zend_ce_exception, "Response cache is disabled", 0);
+        RETURN_FALSE;
+    }
+    obj->cache->disk.reset();
+    if (path_len == 0) {
+        RETURN_TRUE;
+    }
+    if (max_bytes < 0) {
+        zend_throw_exception(zend_ce_exception, "Cache file size must be >= 0", 0);
+        RETURN_FALSE;
+    }
+    std::string error;
+    obj->cache->disk = kislayphp_disk_open(std::string(path, path_len), static_cast<size_t>(max_bytes), error);
+    if (!obj->cache->disk) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
     }
-
-    std::lock_guard<std::mutex> guard(obj->lock);
-    obj->routes.push_back(route);
     RETURN_TRUE;
 }
 
-PHP_METHOD(KislayPHPGateway, routes) {
-    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
-    array_init(return_value);
-    std::lock_guard<std::mutex> guard(obj->lock);
-    for (const auto &route : obj->routes) {
-        zval entry;
-        array_init(&entry);
-        add_assoc_string(&entry, "method", route.method.c_str());
-        add_assoc_string(&entry, "path", route.path.c_str());
-        if (route.use_service) {
-            add_assoc_string(&entry, "service", route.service.c_str());
-        } else {
-            add_assoc_string(&entry, "target", route.target.c_str());
+// Drops every cached response whose Surrogate-Key or Cache-Tag header named
+// one of tags. Returns the number of responses purged.
+PHP_METHOD(KislayPHPGateway, purgeTags) {
+    HashTable *tags = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_ARRAY_HT(tags)
+    ZEND_PARSE_PARAMETERS_END();
+
+    std::vector<std::string> names;
+    zval *tag = nullptr;
+    ZEND_HASH_FOREACH_VAL(tags, tag) {
+        if (Z_TYPE_P(tag) != IS_STRING) {
+            zend_throw_exception(zend_ce_exception, "Tags must be strings", 0);
+            RETURN_FALSE;
         }
-        add_next_index_zval(return_value, &entry);
+        names.emplace_back(Z_STRVAL_P(tag), Z_STRLEN_P(tag));
+    } ZEND_HASH_FOREACH_END();
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (!obj->cache) {
+        RETURN_LONG(0);
     }
+    // Disk first: a lookup that misses memory meanwhile must not promote
+    // a copy the memory purge has already passed. A response held by both
+    // tiers counts once.
+    std::unordered_set<std::string> purged;
+    if (obj->cache->disk) {
+        kislayphp_disk_purge_tags(*obj->cache->disk, names, purged);
+    }
+    kislayphp_cache_purge_tags(*obj->cache, names, purged);
+    RETURN_LONG(static_cast<zend_long>(purged.size()));
 }
 
-PHP_METHOD(KislayPHPGateway, setThreads) {
-    zend_long count = 1;
-    ZEND_PARSE_PARAMETERS_START(1, 1)
-        Z_PARAM_LONG(count)
+// Enables adaptive per-upstream concurrency limits of at most max requests
+// in flight; 0 disables them. Options: initial (20), min (1), queue_ms (how
+// long a request over the limit may wait for a slot before a 503, 50),
+// tolerance (how far over its average latency an upstream may get before
+// that counts as congestion, 2.0)
+// and backoff (factor the limit is cut by, 0.9).
+PHP_METHOD(KislayPHPGateway, setConcurrencyLimit) {
+    zend_long max = 0;
+    HashTable *options = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_LONG(max)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_HT(options)
     ZEND_PARSE_PARAMETERS_END();
 
-    if (count < 1) {
-        zend_throw_exception(zend_ce_exception, "Thread count must be >= 1", 0);
+    zend_long initial = 20;
+    zend_long min = 1;
+    zend_long queue_ms = 50;
+    double tolerance = 2.0;
+    double backoff = 0.9;
+    if (options != nullptr) {
+        zend_string *key = nullptr;
+        zval *value = nullptr;
+        ZEND_HASH_FOREACH_STR_KEY_VAL(options, key, value) {
+            std::string option = key != nullptr ? std::string(ZSTR_VAL(key), ZSTR_LEN(key)) : std::string();
+            if (option == "initial") {
+                initial = zval_get_long(value);
+            } else if (option == "min") {
+                min = zval_get_long(value);
+            } else if (option == "queue_ms") {
+                queue_ms = zval_get_long(value);
+            } else if (option == "tolerance") {
+                tolerance = zval_get_double(value);
+            } else if (option == "backoff") {
+                backoff = zval_get_double(value);
+            } else {
+                std::string error = "Unknown concurrency limit option: " + option;
+                zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+                RETURN_FALSE;
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+    if (max < 0 || max > INT_MAX) {
+        zend_throw_exception(zend_ce_exception, "Concurrency limit must be >= 0", 0);
+        RETURN_FALSE;
+    }
+    if (max > 0 && (min < 1 || min > max || initial < min || initial > max)) {
+        zend_throw_exception(zend_ce_exception, "Concurrency limits must satisfy 1 <= min <= initial <= max", 0);
+        RETURN_FALSE;
+    }
+    if (queue_ms < 0 || queue_ms > INT_MAX) {
+        zend_throw_exception(zend_ce_exception, "Concurrency queue_ms must be >= 0", 0);
+        RETURN_FALSE;
+    }
+    if (!(tolerance >= 1.0) || !(backoff > 0.0 && backoff < 1.0)) {
+        zend_throw_exception(zend_ce_exception, "Concurrency tolerance must be >= 1 and backoff between 0 and 1", 0);
         RETURN_FALSE;
     }
 
@@ -569,10 +5838,195 @@ PHP_METHOD(KislayPHPGateway, setThreads) {
         RETURN_FALSE;
     }
 
-    obj->thread_count = static_cast<int>(count);
+    obj->limit_max = static_cast<int>(max);
+    obj->limit_min = static_cast<int>(min);
+    obj->limit_initial = static_cast<int>(initial);
+    obj->limit_queue_ms = static_cast<int>(queue_ms);
+    obj->limit_tolerance = tolerance;
+    obj->limit_backoff = backoff;
+    std::lock_guard<std::mutex> guard(obj->upstream_lock);
+    for (auto &entry : obj->upstreams) {
+        kislayphp_limit_reset(obj, entry.second.get());
+    }
+    RETURN_TRUE;
+}
+
+// Enables active health checks: every upstream gets "GET <path>" once per
+// interval from a gateway-owned thread while the gateway is running. An
+// empty path disables them.
+PHP_METHOD(KislayPHPGateway, setHealthCheck) {
+    char *path = nullptr;
+    size_t path_len = 0;
+    HashTable *options = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(path, path_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_HT(options)
+    ZEND_PARSE_PARAMETERS_END();
+
+    std::string health_path(path, path_len);
+    if (!health_path.empty() &&
+        (health_path[0] != '/' || health_path.find_first_of(" \r\n\t") != std::string::npos)) {
+        zend_throw_exception(zend_ce_exception, "Health check path must start with / and contain no whitespace", 0);
+        RETURN_FALSE;
+    }
+    zend_long interval_ms = 5000;
+    zend_long timeout_ms = 2000;
+    zend_long healthy_threshold = 2;
+    zend_long unhealthy_threshold = 3;
+    std::vector<int> statuses;
+    if (options != nullptr) {
+        zend_string *key = nullptr;
+        zval *value = nullptr;
+        ZEND_HASH_FOREACH_STR_KEY_VAL(options, key, value) {
+            std::string option = key != nullptr ? std::string(ZSTR_VAL(key), ZSTR_LEN(key)) : std::string();
+            if (option == "interval_ms") {
+                interval_ms = zval_get_long(value);
+            } else if (option == "timeout_ms") {
+                timeout_ms = zval_get_long(value);
+            } else if (option == "healthy_threshold") {
+                healthy_threshold = zval_get_long(value);
+            } else if (option == "unhealthy_threshold") {
+                unhealthy_threshold = zval_get_long(value);
+            } else if (option == "expected_status") {
+                zval *status = nullptr;
+                if (Z_TYPE_P(value) == IS_LONG) {
+                    statuses.push_back(static_cast<int>(Z_LVAL_P(value)));
+                } else if (Z_TYPE_P(value) == IS_ARRAY) {
+                    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(value), status) {
+                        if (Z_TYPE_P(status) != IS_LONG) {
+                            zend_throw_exception(zend_ce_exception, "expected_status must be an int or a list of ints", 0);
+                            RETURN_FALSE;
+                        }
+                        statuses.push_back(static_cast<int>(Z_LVAL_P(status)));
+                    } ZEND_HASH_FOREACH_END();
+                } else {
+                    zend_throw_exception(zend_ce_exception, "expected_status must be an int or a list of ints", 0);
+                    RETURN_FALSE;
+                }
+            } else {
+                std::string error = "Unknown health check option: " + option;
+                zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+                RETURN_FALSE;
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+    if (interval_ms < 1 || timeout_ms < 1) {
+        zend_throw_exception(zend_ce_exception, "Health check interval and timeout must be >= 1 ms", 0);
+        RETURN_FALSE;
+    }
+    if (healthy_threshold < 1 || unhealthy_threshold < 1) {
+        zend_throw_exception(zend_ce_exception, "Health check thresholds must be >= 1", 0);
+        RETURN_FALSE;
+    }
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
+
+    obj->health_path = health_path;
+    obj->health_interval_ms = static_cast<int>(interval_ms);
+    obj->health_timeout_ms = static_cast<int>(timeout_ms);
+    obj->health_healthy_threshold = static_cast<int>(healthy_threshold);
+    obj->health_unhealthy_threshold = static_cast<int>(unhealthy_threshold);
+    obj->health_statuses = statuses;
     RETURN_TRUE;
 }
 
+PHP_METHOD(KislayPHPGateway, getStats) {
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    kislayphp_executor_warn(obj);
+    size_t idle = 0;
+    int64_t now_ns = kislayphp_now_ns();
+    zval upstreams;
+    array_init(&upstreams);
+    {
+        std::lock_guard<std::mutex> guard(obj->upstream_lock);
+        for (auto &entry : obj->upstreams) {
+            size_t upstream_idle = 0;
+            {
+                std::lock_guard<std::mutex> pool_guard(entry.second->lock);
+                upstream_idle = entry.second->idle.size();
+            }
+            idle += upstream_idle;
+            zval upstream;
+            array_init(&upstream);
+            add_assoc_long(&upstream, "in_flight", static_cast<zend_long>(entry.second->in_flight.load(std::memory_order_relaxed)));
+            add_assoc_long(&upstream, "idle", static_cast<zend_long>(upstream_idle));
+            add_assoc_bool(&upstream, "healthy", entry.second->healthy.load(std::memory_order_relaxed));
+            add_assoc_bool(&upstream, "ejected", entry.second->ejected_until.load(std::memory_order_relaxed) > now_ns);
+            add_assoc_long(&upstream, "ejections", static_cast<zend_long>(entry.second->ejections.load(std::memory_order_relaxed)));
+            add_assoc_string(&upstream, "circuit", kislayphp_breaker_state_name(entry.second->breaker));
+            add_assoc_double(&upstream, "latency_ewma_ms", entry.second->latency_ewma.load(std::memory_order_relaxed) / 1e6);
+            if (obj->limit_max > 0) {
+                add_assoc_long(&upstream, "concurrency_limit",
+                               static_cast<zend_long>(entry.second->concurrency_limit.load(std::memory_order_relaxed)));
+            }
+            add_assoc_zval(&upstreams, entry.first.c_str(), &upstream);
+        }
+    }
+    array_init(return_value);
+    add_assoc_long(return_value, "pool_hits", static_cast<zend_long>(obj->pool_hits.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "pool_misses", static_cast<zend_long>(obj->pool_misses.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "pool_idle", static_cast<zend_long>(idle));
+    add_assoc_long(return_value, "resolve_hits", static_cast<zend_long>(obj->resolve_hits.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "resolve_stale", static_cast<zend_long>(obj->resolve_stale.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "resolver_calls", static_cast<zend_long>(obj->resolver_calls.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "retries", static_cast<zend_long>(obj->retries_done.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "retries_denied", static_cast<zend_long>(obj->retries_denied.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "limit_shed", static_cast<zend_long>(obj->limit_shed.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "hedges", static_cast<zend_long>(obj->hedges.load(std::memory_order_relaxed)));
+    add_assoc_long(return_value, "hedge_wins", static_cast<zend_long>(obj->hedge_wins.load(std::memory_order_relaxed)));
+    if (obj->cache) {
+        kislayphp_response_cache &cache = *obj->cache;
+        size_t entries = 0;
+        size_t bytes = 0;
+        for (const auto &shard : cache.shards) {
+            std::lock_guard<std::mutex> guard(shard->lock);
+            for (const auto &slot : shard->slots) {
+                entries += slot.second.variants.size();
+            }
+            bytes += shard->bytes;
+        }
+        zval cache_stats;
+        array_init(&cache_stats);
+        add_assoc_long(&cache_stats, "entries", static_cast<zend_long>(entries));
+        add_assoc_long(&cache_stats, "bytes", static_cast<zend_long>(bytes));
+        add_assoc_long(&cache_stats, "hits", static_cast<zend_long>(cache.hits.load(std::memory_order_relaxed)));
+        add_assoc_long(&cache_stats, "misses", static_cast<zend_long>(cache.misses.load(std::memory_order_relaxed)));
+        add_assoc_long(&cache_stats, "stores", static_cast<zend_long>(cache.stores.load(std::memory_order_relaxed)));
+        add_assoc_long(&cache_stats, "evictions", static_cast<zend_long>(cache.evictions.load(std::memory_order_relaxed)));
+        add_assoc_long(&cache_stats, "coalesced", static_cast<zend_long>(cache.coalesced.load(std::memory_order_relaxed)));
+        add_assoc_long(&cache_stats, "revalidated", static_cast<zend_long>(cache.revalidated.load(std::memory_order_relaxed)));
+        if (cache.disk) {
+            kislayphp_disk_tier &disk = *cache.disk;
+            size_t disk_entries = 0;
+            for (auto &shard : disk.shards) {
+                std::lock_guard<std::mutex> guard(shard->lock);
+                disk_entries += shard->entries;
+            }
+            zval disk_stats;
+            array_init(&disk_stats);
+            add_assoc_long(&disk_stats, "entries", static_cast<zend_long>(disk_entries));
+            add_assoc_long(&disk_stats, "bytes", static_cast<zend_long>(disk.size));
+            add_assoc_long(&disk_stats, "hits", static_cast<zend_long>(disk.hits.load(std::memory_order_relaxed)));
+            add_assoc_long(&disk_stats, "writes", static_cast<zend_long>(disk.writes.load(std::memory_order_relaxed)));
+            add_assoc_zval(&cache_stats, "disk", &disk_stats);
+        }
+        add_assoc_zval(return_value, "cache", &cache_stats);
+    }
+    add_assoc_long(return_value, "resolver_coalesced", static_cast<zend_long>(obj->resolver_coalesced.load(std::memory_order_relaxed)));
+    add_assoc_zval(return_value, "upstreams", &upstreams);
+}
+
+// Sets the callable that maps a service route to its target. It is PHP code,
+// so it only runs on the script's thread while the script is inside wait();
+// call wait() in a loop after listen() rather than sleep(). A request that
+// needs it waits for the next wait() up to its first-byte timeout or
+// deadline and then fails with 503. A resolver that throws fails that
+// request with 502.
 PHP_METHOD(KislayPHPGateway, setResolver) {
     zval *resolver = nullptr;
     ZEND_PARSE_PARAMETERS_START(1, 1)
@@ -592,6 +6046,32 @@ PHP_METHOD(KislayPHPGateway, setResolver) {
     }
     ZVAL_COPY(&obj->resolver, resolver);
     obj->has_resolver = true;
+    obj->resolver_generation.fetch_add(1, std::memory_order_relaxed);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPGateway, setResolverCache) {
+    zend_long ttl_ms = 0;
+    zend_long stale_ms = 10000;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_LONG(ttl_ms)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(stale_ms)
+    ZEND_PARSE_PARAMETERS_END();
+
+    if (ttl_ms < 0 || stale_ms < 0) {
+        zend_throw_exception(zend_ce_exception, "Resolver cache times must be >= 0 ms", 0);
+        RETURN_FALSE;
+    }
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx != nullptr) {
+        zend_throw_exception(zend_ce_exception, "Gateway already running", 0);
+        RETURN_FALSE;
+    }
+
+    obj->resolve_ttl_ms = static_cast<int>(ttl_ms);
+    obj->resolve_stale_ms = static_cast<int>(stale_ms);
     RETURN_TRUE;
 }
 
@@ -622,22 +6102,215 @@ PHP_METHOD(KislayPHPGateway, listen) {
     std::string threads_value = std::to_string(obj->thread_count);
     options.push_back("num_threads");
     options.push_back(threads_value.c_str());
+    std::string keep_alive_timeout = std::to_string(obj->keep_alive_timeout_ms);
+    options.push_back("enable_keep_alive");
+    options.push_back(obj->keep_alive ? "yes" : "no");
+    if (obj->keep_alive) {
+        options.push_back("keep_alive_timeout_ms");
+        options.push_back(keep_alive_timeout.c_str());
+    }
     options.push_back(nullptr);
 
     struct mg_callbacks callbacks;
     std::memset(&callbacks, 0, sizeof(callbacks));
     callbacks.begin_request = kislayphp_gateway_begin_request;
+    callbacks.init_thread = kislayphp_gateway_init_thread;
+    callbacks.exit_thread = kislayphp_gateway_exit_thread;
 
+    obj->executor_closed.store(false, std::memory_order_release);
     obj->ctx = mg_start(&callbacks, obj, options.data());
     if (obj->ctx == nullptr) {
         zend_throw_exception(zend_ce_exception, "Failed to start gateway", 0);
         RETURN_FALSE;
     }
 
+    kislayphp_health_start(obj);
     obj->running = true;
     RETURN_TRUE;
 }
 
+// Parks the PHP thread as the executor for resolver callbacks until the
+// timeout expires (forever when negative). Jobs queued while the script is
+// elsewhere are run on the next call. Returns whether the gateway is still
+// running.
+PHP_METHOD(KislayPHPGateway, wait) {
+    zend_long timeout_ms = -1;
+    ZEND_PARSE_PARAMETERS_START(0, 1)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(timeout_ms)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    if (obj->ctx == nullptr) {
+        RETURN_FALSE;
+    }
+
+    kislayphp_executor_warn(obj);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms < 0 ? 0 : timeout_ms);
+    obj->executor_active.store(true, std::memory_order_release);
+    while (EG(exception) == nullptr) {
+        kislayphp_executor_drain(obj);
+        std::unique_lock<std::mutex> guard(obj->executor_lock);
+        if (obj->executor_head.load(std::memory_order_acquire) != nullptr) {
+            continue;
+        }
+        auto slice = std::chrono::milliseconds(100);
+        if (timeout_ms >= 0) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                break;
+            }
+            slice = std::min(slice, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) +
+                                        std::chrono::milliseconds(1));
+        }
+        obj->executor_cv.wait_for(guard, slice);
+    }
+    obj->executor_active.store(false, std::memory_order_seq_cst);
+    kislayphp_executor_drain(obj);
+    RETURN_BOOL(obj->ctx != nullptr);
+}
+
+PHP_METHOD(KislayPHPGateway, registerService) {
+    char *name = nullptr;
+    size_t name_len = 0;
+    HashTable *targets = nullptr;
+    HashTable *options = nullptr;
+    ZEND_PARSE_PARAMETERS_START(2, 3)
+        Z_PARAM_STRING(name, name_len)
+        Z_PARAM_ARRAY_HT(targets)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_HT(options)
+    ZEND_PARSE_PARAMETERS_END();
+
+    if (name_len == 0) {
+        zend_throw_exception(zend_ce_exception, "Service name must not be empty", 0);
+        RETURN_FALSE;
+    }
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    std::vector<kislayphp_endpoint> endpoints;
+    std::string error;
+    if (!kislayphp_parse_targets(obj, targets, endpoints, error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    bool append = false;
+    bool has_balancer = false;
+    bool has_hash_key = false;
+    kislayphp_balancing balancing;
+    if (options != nullptr) {
+        zend_string *key = nullptr;
+        zval *value = nullptr;
+        ZEND_HASH_FOREACH_STR_KEY_VAL(options, key, value) {
+            std::string option = key != nullptr ? std::string(ZSTR_VAL(key), ZSTR_LEN(key)) : std::string();
+            if (option == "append") {
+                append = zend_is_true(value);
+            } else if (option == "balancer" || option == "hash_key") {
+                if (!kislayphp_apply_balancing_option(option, value, balancing, error)) {
+                    zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+                    RETURN_FALSE;
+                }
+                (option == "balancer" ? has_balancer : has_hash_key) = true;
+            } else {
+                error = "Unknown service option: " + (key != nullptr ? std::string(ZSTR_VAL(key), ZSTR_LEN(key)) : std::string("#"));
+                zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+                RETURN_FALSE;
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+
+    std::string service_name(name, name_len);
+    std::lock_guard<std::mutex> guard(obj->lock);
+    auto service = std::make_shared<kislayphp_target_set>();
+    service->balancing = balancing;
+    std::shared_ptr<const kislayphp_registry> current = obj->registry.load();
+    auto existing = current->services.find(service_name);
+    if (existing != current->services.end()) {
+        if (append) {
+            service->endpoints = existing->second->endpoints;
+        }
+        if (!has_balancer) {
+            service->balancing.balancer = existing->second->balancing.balancer;
+        }
+        if (!has_hash_key) {
+            service->balancing.hash_key = existing->second->balancing.hash_key;
+        }
+    }
+    for (auto &endpoint : endpoints) {
+        bool known = std::any_of(service->endpoints.begin(), service->endpoints.end(),
+                                 [&endpoint](const kislayphp_endpoint &other) { return other.target == endpoint.target; });
+        if (!known) {
+            service->endpoints.push_back(std::move(endpoint));
+        }
+    }
+    kislayphp_build_maglev(*service);
+    kislayphp_update_registry(obj, service_name, service);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPGateway, deregisterService) {
+    char *name = nullptr;
+    size_t name_len = 0;
+    HashTable *targets = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(name, name_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_HT(targets)
+    ZEND_PARSE_PARAMETERS_END();
+
+    std::vector<std::string> remove;
+    if (targets != nullptr) {
+        zval *value = nullptr;
+        ZEND_HASH_FOREACH_VAL(targets, value) {
+            if (Z_TYPE_P(value) != IS_STRING) {
+                zend_throw_exception(zend_ce_exception, "Targets must be strings", 0);
+                RETURN_FALSE;
+            }
+            remove.emplace_back(Z_STRVAL_P(value), Z_STRLEN_P(value));
+        } ZEND_HASH_FOREACH_END();
+    }
+
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    std::string service_name(name, name_len);
+    std::lock_guard<std::mutex> guard(obj->lock);
+    std::shared_ptr<const kislayphp_registry> current = obj->registry.load();
+    auto existing = current->services.find(service_name);
+    if (existing == current->services.end()) {
+        RETURN_FALSE;
+    }
+    if (remove.empty()) {
+        kislayphp_update_registry(obj, service_name, nullptr);
+        RETURN_TRUE;
+    }
+    auto service = std::make_shared<kislayphp_target_set>();
+    service->balancing = existing->second->balancing;
+    for (const auto &endpoint : existing->second->endpoints) {
+        if (std::find(remove.begin(), remove.end(), endpoint.target) == remove.end()) {
+            service->endpoints.push_back(endpoint);
+        }
+    }
+    if (service->endpoints.size() == existing->second->endpoints.size()) {
+        RETURN_FALSE;
+    }
+    kislayphp_build_maglev(*service);
+    kislayphp_update_registry(obj, service_name, service->endpoints.empty() ? nullptr : service);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPGateway, services) {
+    php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
+    array_init(return_value);
+    std::lock_guard<std::mutex> guard(obj->lock);
+    std::shared_ptr<const kislayphp_registry> registry = obj->registry.load();
+    for (const auto &entry : registry->services) {
+        zval targets;
+        array_init(&targets);
+        for (const auto &endpoint : entry.second->endpoints) {
+            add_next_index_string(&targets, endpoint.target.c_str());
+        }
+        add_assoc_zval(return_value, entry.first.c_str(), &targets);
+    }
+}
+
 PHP_METHOD(KislayPHPGateway, setFallbackTarget) {
     char *target = nullptr;
     size_t target_len = 0;
@@ -649,16 +6322,16 @@ PHP_METHOD(KislayPHPGateway, setFallbackTarget) {
     kislayphp_gateway_route route;
     route.method = "*";
     route.path = "*";
-    route.target.assign(target, target_len);
     route.use_service = false;
-    if (!kislayphp_parse_target(route.target, route)) {
+    route.targets = std::make_shared<kislayphp_target_set>();
+    route.targets->endpoints.emplace_back();
+    if (!kislayphp_parse_target(std::string(target, target_len), route.targets->endpoints[0])) {
         zend_throw_exception(zend_ce_exception, "Invalid fallback target (expected http://host:port)", 0);
         RETURN_FALSE;
     }
+    kislayphp_bind_endpoint(obj, route.targets->endpoints[0]);
 
-    std::lock_guard<std::mutex> guard(obj->lock);
-    obj->fallback_route = route;
-    obj->has_fallback = true;
+    kislayphp_set_fallback(obj, route);
     RETURN_TRUE;
 }
 
@@ -673,23 +6346,26 @@ PHP_METHOD(KislayPHPGateway, setFallbackService) {
     kislayphp_gateway_route route;
     route.method = "*";
     route.path = "*";
-    route.target.clear();
     route.service.assign(service, service_len);
     route.use_service = true;
+    route.resolution = std::make_shared<kislayphp_resolution_slot>();
 
-    std::lock_guard<std::mutex> guard(obj->lock);
-    obj->fallback_route = route;
-    obj->has_fallback = true;
+    kislayphp_set_fallback(obj, route);
     RETURN_TRUE;
 }
 
 PHP_METHOD(KislayPHPGateway, stop) {
     php_kislayphp_gateway_t *obj = php_kislayphp_gateway_from_obj(Z_OBJ_P(getThis()));
     obj->running = false;
+    obj->executor_closed.store(true, std::memory_order_release);
+    kislayphp_health_stop(obj);
     if (obj->ctx != nullptr) {
         mg_stop(obj->ctx);
         obj->ctx = nullptr;
     }
+    kislayphp_hedge_drain(obj);
+    kislayphp_pool_clear(obj);
+    kislayphp_executor_warn(obj);
     RETURN_TRUE;
 }
 
@@ -699,7 +6375,23 @@ static const zend_function_entry kislayphp_gateway_methods[] = {
     PHP_ME(KislayPHPGateway, addServiceRoute, arginfo_kislayphp_gateway_add_service, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPGateway, routes, arginfo_kislayphp_gateway_void, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPGateway, setThreads, arginfo_kislayphp_gateway_set_threads, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setConnectionPool, arginfo_kislayphp_gateway_set_connection_pool, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setKeepAlive, arginfo_kislayphp_gateway_set_keep_alive, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setHealthCheck, arginfo_kislayphp_gateway_set_health_check, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setConcurrencyLimit, arginfo_kislayphp_gateway_set_concurrency_limit, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setResponseCache, arginfo_kislayphp_gateway_set_response_cache, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setCacheFile, arginfo_kislayphp_gateway_set_cache_file, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, purgeTags, arginfo_kislayphp_gateway_purge_tags, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setRetryPolicy, arginfo_kislayphp_gateway_set_retry_policy, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setTimeouts, arginfo_kislayphp_gateway_set_timeouts, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setOutlierDetection, arginfo_kislayphp_gateway_set_outlier_detection, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, getStats, arginfo_kislayphp_gateway_void, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, registerService, arginfo_kislayphp_gateway_register_service, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, deregisterService, arginfo_kislayphp_gateway_deregister_service, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, services, arginfo_kislayphp_gateway_void, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPGateway, setResolver, arginfo_kislayphp_gateway_set_resolver, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, setResolverCache, arginfo_kislayphp_gateway_set_resolver_cache, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPGateway, wait, arginfo_kislayphp_gateway_wait, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPGateway, setFallbackTarget, arginfo_kislayphp_gateway_set_fallback, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPGateway, setFallbackService, arginfo_kislayphp_gateway_set_fallback_service, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPGateway, listen, arginfo_kislayphp_gateway_listen, ZEND_ACC_PUBLIC)
@@ -715,6 +6407,7 @@ PHP_MINIT_FUNCTION(kislayphp_gateway) {
     std::memcpy(&kislayphp_gateway_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
     kislayphp_gateway_handlers.offset = XtOffsetOf(php_kislayphp_gateway_t, std);
     kislayphp_gateway_handlers.free_obj = kislayphp_gateway_free_obj;
+    kislayphp_gateway_handlers.dtor_obj = kislayphp_gateway_dtor_obj;
     return SUCCESS;
 }
 
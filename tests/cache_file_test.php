@@ -0,0 +1,178 @@
+<?php
+function require_extension($name) {
+    if (!extension_loaded($name)) {
+        fwrite(STDERR, "Missing extension: {$name}\n");
+        exit(1);
+    }
+}
+
+function read_response($fp) {
+    $head = '';
+    while (($line = fgets($fp)) !== false) {
+        $head .= $line;
+        if ($line === "\r\n") {
+            break;
+        }
+    }
+    if ($head === '') {
+        return null;
+    }
+    $length = 0;
+    if (preg_match('/^Content-Length:\s*(\d+)/mi', $head, $m)) {
+        $length = (int)$m[1];
+    }
+    $body = '';
+    while (strlen($body) < $length && !feof($fp)) {
+        $body .= fread($fp, $length - strlen($body));
+    }
+    return [$head, $body];
+}
+
+// Runs a gateway on the shared cache file in a child process. When $purge
+// is set the child purges that tag after listening and writes the count to
+// $purge_result.
+function start_gateway($cache_file, $gateway_port, $purge = null, $purge_result = null) {
+    $pid = pcntl_fork();
+    if ($pid !== 0) {
+        usleep(300000);
+        return $pid;
+    }
+    $gateway = new KislayPHP\Gateway\Gateway();
+    $gateway->addRoute('GET', '/item', 'http://127.0.0.1:19061', ['cache' => true]);
+    $gateway->setCacheFile($cache_file, 4 << 20);
+    $gateway->listen('127.0.0.1', $gateway_port);
+    if ($purge !== null) {
+        file_put_contents($purge_result, (string)$gateway->purgeTags([$purge]));
+    }
+    sleep(10);
+    exit(0);
+}
+
+function stop_gateway($pid) {
+    posix_kill($pid, SIGTERM);
+    pcntl_waitpid($pid, $status);
+}
+
+function fetch($gateway_port) {
+    $fp = fsockopen('127.0.0.1', $gateway_port, $errno, $errstr, 2.0);
+    if (!$fp) {
+        return null;
+    }
+    stream_set_timeout($fp, 2);
+    fwrite($fp, "GET /item HTTP/1.1\r\nHost: 127.0.0.1:{$gateway_port}\r\nConnection: close\r\n\r\n");
+    $response = read_response($fp);
+    fclose($fp);
+    if ($response === null) {
+        return null;
+    }
+    $cache = preg_match('/^X-Cache:\s*(\S+)/mi', $response[0], $m) ? $m[1] : '-';
+    return $cache . ' ' . $response[1];
+}
+
+// Flips a byte in the head of every record so its checksum fails.
+function corrupt_records($cache_file) {
+    $data = file_get_contents($cache_file);
+    $count = 0;
+    for ($offset = 1 << 20; $offset + 28 <= strlen($data); $offset += 1024) {
+        if (unpack('V', substr($data, $offset, 4))[1] === 0x4b524543) {
+            $data[$offset + 24] = chr(ord($data[$offset + 24]) ^ 0x40);
+            ++$count;
+        }
+    }
+    file_put_contents($cache_file, $data);
+    return $count;
+}
+
+require_extension('kislayphp_gateway');
+
+if (!function_exists('pcntl_fork') || !function_exists('posix_kill')) {
+    fwrite(STDERR, "pcntl/posix not available; run manually in two terminals.\n");
+    exit(0);
+}
+
+$upstream_dir = sys_get_temp_dir() . '/kislay_gateway_test_' . uniqid();
+if (!mkdir($upstream_dir, 0700, true)) {
+    fwrite(STDERR, "Failed to create temp dir.\n");
+    exit(1);
+}
+// Answers with the number of requests it has served.
+file_put_contents(
+    $upstream_dir . '/index.php',
+    "<?php\n" .
+    "\$count = (int)@file_get_contents(__DIR__ . '/count') + 1;\n" .
+    "file_put_contents(__DIR__ . '/count', (string)\$count);\n" .
+    "header('Cache-Control: max-age=60');\n" .
+    "header('Surrogate-Key: item');\n" .
+    "echo \$count;\n"
+);
+$cache_file = $upstream_dir . '/cache.bin';
+$purge_result = $upstream_dir . '/purged';
+
+$upstream_port = 19061;
+$gateway_port = 19062;
+
+$descriptor = [
+    0 => ['pipe', 'r'],
+    1 => ['pipe', 'w'],
+    2 => ['pipe', 'w'],
+];
+$cmd = sprintf(
+    'php -S 127.0.0.1:%d -t %s %s',
+    $upstream_port,
+    escapeshellarg($upstream_dir),
+    escapeshellarg($upstream_dir . '/index.php')
+);
+$process = proc_open($cmd, $descriptor, $pipes);
+if (!is_resource($process)) {
+    fwrite(STDERR, "Failed to start upstream server.\n");
+    exit(1);
+}
+
+$responses = [];
+
+// The first gateway fills the file.
+$pid = start_gateway($cache_file, $gateway_port);
+$responses['fill'] = fetch($gateway_port);
+$responses['fill_hit'] = fetch($gateway_port);
+stop_gateway($pid);
+
+// A restarted gateway serves the stored response without the upstream.
+$pid = start_gateway($cache_file, $gateway_port);
+$responses['warm_restart'] = fetch($gateway_port);
+stop_gateway($pid);
+
+// A torn record is dropped on open and the response fetched again.
+$responses['corrupted'] = corrupt_records($cache_file);
+$pid = start_gateway($cache_file, $gateway_port);
+$responses['torn_record'] = fetch($gateway_port);
+stop_gateway($pid);
+
+// Purging a tag removes the stored response from the file.
+$pid = start_gateway($cache_file, $gateway_port, 'item', $purge_result);
+$responses['purged'] = @file_get_contents($purge_result);
+$responses['after_purge'] = fetch($gateway_port);
+stop_gateway($pid);
+
+proc_terminate($process);
+proc_close($process);
+@unlink($upstream_dir . '/index.php');
+@unlink($upstream_dir . '/count');
+@unlink($cache_file);
+@unlink($purge_result);
+@rmdir($upstream_dir);
+
+$expected = [
+    'fill' => 'MISS 1',
+    'fill_hit' => 'HIT 1',
+    'warm_restart' => 'HIT 1',
+    'corrupted' => 1,
+    'torn_record' => 'MISS 2',
+    'purged' => '1',
+    'after_purge' => 'MISS 3',
+];
+if ($responses !== $expected) {
+    fwrite(STDERR, "Unexpected responses:\n" . var_export($responses, true) . "\n");
+    exit(1);
+}
+
+fwrite(STDOUT, "OK\n");
@@ -0,0 +1,161 @@
+<?php
+function require_extension($name) {
+    if (!extension_loaded($name)) {
+        fwrite(STDERR, "Missing extension: {$name}\n");
+        exit(1);
+    }
+}
+
+function read_response($fp) {
+    $head = '';
+    while (($line = fgets($fp)) !== false) {
+        $head .= $line;
+        if ($line === "\r\n") {
+            break;
+        }
+    }
+    if ($head === '') {
+        return null;
+    }
+    $length = 0;
+    if (preg_match('/^Content-Length:\s*(\d+)/mi', $head, $m)) {
+        $length = (int)$m[1];
+    }
+    $body = '';
+    while (strlen($body) < $length && !feof($fp)) {
+        $body .= fread($fp, $length - strlen($body));
+    }
+    return [$head, $body];
+}
+
+function send_request($gateway_port, $path) {
+    $fp = fsockopen('127.0.0.1', $gateway_port, $errno, $errstr, 2.0);
+    if (!$fp) {
+        return null;
+    }
+    stream_set_timeout($fp, 5);
+    fwrite($fp, "GET {$path} HTTP/1.1\r\nHost: 127.0.0.1:{$gateway_port}\r\nConnection: close\r\n\r\n");
+    return $fp;
+}
+
+function read_status($fp) {
+    if (!$fp) {
+        return 0;
+    }
+    $response = read_response($fp);
+    fclose($fp);
+    if ($response === null || !preg_match('/^HTTP\/\S+\s+(\d+)/', $response[0], $m)) {
+        return 0;
+    }
+    return (int)$m[1];
+}
+
+require_extension('kislayphp_gateway');
+
+if (!function_exists('pcntl_fork') || !function_exists('posix_kill')) {
+    fwrite(STDERR, "pcntl/posix not available; run manually in two terminals.\n");
+    exit(0);
+}
+
+$upstream_dir = sys_get_temp_dir() . '/kislay_gateway_test_' . uniqid();
+if (!mkdir($upstream_dir, 0700, true)) {
+    fwrite(STDERR, "Failed to create temp dir.\n");
+    exit(1);
+}
+file_put_contents(
+    $upstream_dir . '/index.php',
+    "<?php\n" .
+    "\$path = parse_url(\$_SERVER['REQUEST_URI'], PHP_URL_PATH);\n" .
+    "if (\$path === '/slow') { usleep(1500000); }\n" .
+    "if (\$path === '/fail') { http_response_code(500); }\n" .
+    "echo 'ok';\n"
+);
+
+$upstream_port = 19071;
+$gateway_port = 19072;
+
+$descriptor = [
+    0 => ['pipe', 'r'],
+    1 => ['pipe', 'w'],
+    2 => ['pipe', 'w'],
+];
+$cmd = sprintf(
+    'php -S 127.0.0.1:%d -t %s %s',
+    $upstream_port,
+    escapeshellarg($upstream_dir),
+    escapeshellarg($upstream_dir . '/index.php')
+);
+// The slow probe has to overlap the others.
+$env = getenv();
+$env['PHP_CLI_SERVER_WORKERS'] = '4';
+$process = proc_open($cmd, $descriptor, $pipes, null, $env);
+if (!is_resource($process)) {
+    fwrite(STDERR, "Failed to start upstream server.\n");
+    exit(1);
+}
+
+$pid = pcntl_fork();
+if ($pid === -1) {
+    fwrite(STDERR, "Failed to fork.\n");
+    proc_terminate($process);
+    proc_close($process);
+    exit(1);
+}
+
+if ($pid === 0) {
+    $gateway = new KislayPHP\Gateway\Gateway();
+    $gateway->addRoute('GET', '/*', 'http://127.0.0.1:' . $upstream_port, [
+        'circuit_breaker' => ['failures' => 1, 'open_ms' => 300, 'half_open_requests' => 3],
+    ]);
+    $gateway->listen('127.0.0.1', $gateway_port);
+    sleep(10);
+    exit(0);
+}
+
+usleep(500000);
+
+$statuses = [];
+// Trip the breaker.
+$statuses['trip'] = read_status(send_request($gateway_port, '/fail'));
+$statuses['open'] = read_status(send_request($gateway_port, '/ok'));
+
+// First half-open period: a slow probe is still running when the other
+// probe fails and opens the breaker again.
+usleep(400000);
+$slow = send_request($gateway_port, '/slow');
+usleep(100000);
+$statuses['probe_fail'] = read_status(send_request($gateway_port, '/fail'));
+
+// Second half-open period: one good probe, then the slow probe from the
+// first period finishes. It must neither count nor free a probe slot, so
+// two more good probes close the breaker.
+usleep(400000);
+$statuses['probe_ok'] = read_status(send_request($gateway_port, '/ok'));
+$statuses['late_probe'] = read_status($slow);
+$statuses['second_probe'] = read_status(send_request($gateway_port, '/ok'));
+$statuses['closing_probe'] = read_status(send_request($gateway_port, '/ok'));
+$statuses['closed'] = read_status(send_request($gateway_port, '/ok'));
+
+posix_kill($pid, SIGTERM);
+pcntl_waitpid($pid, $status);
+proc_terminate($process);
+proc_close($process);
+@unlink($upstream_dir . '/index.php');
+@rmdir($upstream_dir);
+
+$expected = [
+    'trip' => 500,
+    'open' => 503,
+    'probe_fail' => 500,
+    'probe_ok' => 200,
+    'late_probe' => 200,
+    'second_probe' => 200,
+    'closing_probe' => 200,
+    'closed' => 200,
+];
+if ($statuses !== $expected) {
+    fwrite(STDERR, "Unexpected statuses:\n" . var_export($statuses, true) . "\n");
+    exit(1);
+}
+
+fwrite(STDOUT, "OK\n");
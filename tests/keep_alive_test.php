@@ -0,0 +1,123 @@
+<?php
+function require_extension($name) {
+    if (!extension_loaded($name)) {
+        fwrite(STDERR, "Missing extension: {$name}\n");
+        exit(1);
+    }
+}
+
+function read_response($fp) {
+    $head = '';
+    while (($line = fgets($fp)) !== false) {
+        $head .= $line;
+        if ($line === "\r\n") {
+            break;
+        }
+    }
+    if ($head === '') {
+        return null;
+    }
+    $length = 0;
+    if (preg_match('/^Content-Length:\s*(\d+)/mi', $head, $m)) {
+        $length = (int)$m[1];
+    }
+    $body = '';
+    while (strlen($body) < $length && !feof($fp)) {
+        $body .= fread($fp, $length - strlen($body));
+    }
+    return [$head, $body];
+}
+
+require_extension('kislayphp_gateway');
+
+if (!function_exists('pcntl_fork') || !function_exists('posix_kill')) {
+    fwrite(STDERR, "pcntl/posix not available; run manually in two terminals.\n");
+    exit(0);
+}
+
+$upstream_dir = sys_get_temp_dir() . '/kislay_gateway_test_' . uniqid();
+if (!mkdir($upstream_dir, 0700, true)) {
+    fwrite(STDERR, "Failed to create temp dir.\n");
+    exit(1);
+}
+file_put_contents($upstream_dir . '/index.php', "<?php echo 'OK';\n");
+
+$upstream_port = 19011;
+$gateway_port = 19012;
+
+$descriptor = [
+    0 => ['pipe', 'r'],
+    1 => ['pipe', 'w'],
+    2 => ['pipe', 'w'],
+];
+$cmd = sprintf('php -S 127.0.0.1:%d -t %s', $upstream_port, escapeshellarg($upstream_dir));
+$process = proc_open($cmd, $descriptor, $pipes);
+if (!is_resource($process)) {
+    fwrite(STDERR, "Failed to start upstream server.\n");
+    exit(1);
+}
+
+$pid = pcntl_fork();
+if ($pid === -1) {
+    fwrite(STDERR, "Failed to fork.\n");
+    proc_terminate($process);
+    proc_close($process);
+    exit(1);
+}
+
+if ($pid === 0) {
+    $gateway = new KislayPHP\Gateway\Gateway();
+    $gateway->setKeepAlive(true, 2000, 2);
+    $gateway->addRoute('GET', '/*', 'http://127.0.0.1:19011');
+    $gateway->listen('127.0.0.1', $gateway_port);
+    sleep(10);
+    exit(0);
+}
+
+usleep(300000);
+
+$fp = fsockopen('127.0.0.1', $gateway_port, $errno, $errstr, 2.0);
+if (!$fp) {
+    fwrite(STDERR, "Failed to connect: {$errstr}\n");
+    posix_kill($pid, SIGTERM);
+    pcntl_waitpid($pid, $status);
+    proc_terminate($process);
+    proc_close($process);
+    exit(1);
+}
+stream_set_timeout($fp, 2);
+
+$request = "GET /index.php HTTP/1.1\r\nHost: 127.0.0.1:{$gateway_port}\r\n\r\n";
+$responses = [];
+for ($i = 0; $i < 2; $i++) {
+    fwrite($fp, $request);
+    $responses[] = read_response($fp);
+}
+fclose($fp);
+
+$ok = true;
+foreach ($responses as $i => $response) {
+    if ($response === null || strpos($response[0], '200') === false || $response[1] !== 'OK') {
+        $ok = false;
+    }
+}
+if ($ok && stripos($responses[0][0], "Connection: close") !== false) {
+    $ok = false;
+}
+if ($ok && stripos($responses[1][0], "Connection: close") === false) {
+    $ok = false;
+}
+
+posix_kill($pid, SIGTERM);
+pcntl_waitpid($pid, $status);
+proc_terminate($process);
+proc_close($process);
+@unlink($upstream_dir . '/index.php');
+@rmdir($upstream_dir);
+
+if (!$ok) {
+    fwrite(STDERR, "Unexpected responses:\n" . var_export($responses, true) . "\n");
+    exit(1);
+}
+
+fwrite(STDOUT, "OK\n");